@@ -1,71 +1,490 @@
 #include "b2.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+
+// Publish the tokens produced so far, waking the consumer thread only if it
+// is sleeping on an empty sharedBuffer. The fence pairs with the one in
+// consumeTokens: either the consumer sees the new produceCount before it
+// sleeps, or we see consumerSleeping and signal it. The loop consumer is
+// signalled on its eventfd instead, once per empty to non-empty transition.
+static inline void publishProduced (struct B2 * b2, unsigned int count) {
+  uint64_t one = 1;
+
+  atomic_store_explicit(&b2->produceCount, count, memory_order_release);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (b2->consumer.notifyFd) {
+    if (atomic_load_explicit(&b2->consumerSleeping, memory_order_relaxed) &&
+        atomic_exchange(&b2->consumerSleeping, false))
+      assert(sizeof(one) == write(b2->consumer.notifyFd, &one, sizeof(one)));
+  }
+  else if (atomic_load_explicit(&b2->consumerSleeping, memory_order_relaxed)) {
+    uv_mutex_lock(&b2->tokenProducedMutex);
+    uv_cond_signal(&b2->tokenProduced);
+    uv_mutex_unlock(&b2->tokenProducedMutex);
+  }
+}
+
+// Release the tokens consumed so far, waking the producer thread only if it
+// is sleeping on a full sharedBuffer.
+static inline void publishConsumed (struct B2 * b2, unsigned int count) {
+  atomic_store_explicit(&b2->consumeCount, count, memory_order_release);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&b2->producerSleeping, memory_order_relaxed)) {
+    uv_mutex_lock(&b2->tokenConsumedMutex);
+    uv_cond_signal(&b2->tokenConsumed);
+    uv_mutex_unlock(&b2->tokenConsumedMutex);
+  }
+}
+
+// Spin, per the wait strategy of the b2, until the counter of the other
+// thread moves on from seen or the b2 is closed. Returns false when the
+// thread is to park on its condvar instead.
+static bool spinWait (struct B2 * b2, atomic_uint* counter, unsigned int seen) {
+  unsigned int i;
+
+  for (i = 0; b2->wait != WAIT_BLOCK; i++) {
+    if (atomic_load_explicit(counter, memory_order_acquire) != seen ||
+        !b2->isOpen) return true;
+    if (i < b2->spinBudget || b2->wait == WAIT_SPIN) cpuRelax();
+    else if (b2->wait == WAIT_YIELD) sched_yield();
+    else return false; // WAIT_SPIN_PARK
+  }
+  return false;
+}
+
+static inline bool isFull (struct B2 * b2, unsigned int produceCount) {
+  if (produceCount - b2->consumeCountCached != b2->sharedBuffer_size)
+    return false;
+  b2->consumeCountCached =
+    atomic_load_explicit(&b2->consumeCount, memory_order_acquire);
+  return produceCount - b2->consumeCountCached == b2->sharedBuffer_size;
+}
+
+static inline bool isEmpty (struct B2 * b2, unsigned int consumeCount) {
+  if (consumeCount != b2->produceCountCached) return false;
+  b2->produceCountCached =
+    atomic_load_explicit(&b2->produceCount, memory_order_acquire);
+  return consumeCount == b2->produceCountCached;
+}
+
+// The number of slots from the one at count to the end of the sharedBuffer.
+static inline size_t slotsToEnd (struct B2 * b2, unsigned int count) {
+  return b2->sharedBuffer_size - count % b2->sharedBuffer_size;
+}
 
 static void producer (struct B2 * b2) {
   void (*pt) (TokenType* tt, struct B2 * b2) = b2->producer.produceToken;
+  size_t (*pts) (TokenType* slots, size_t n, struct B2 * b2) =
+    b2->producer.produceTokens;
+  unsigned int count =
+    atomic_load_explicit(&b2->produceCount, memory_order_relaxed);
+
   while (b2->isOpen) {
-    if (b2->produceCount - b2->consumeCount == b2->sharedBuffer_size) break;
-    pt(&b2->sharedBuffer[b2->produceCount % b2->sharedBuffer_size], b2);
-    uv_mutex_lock(&b2->tokenProducedMutex);
-    if (b2->produceCount++ - b2->consumeCount == 0) {
-      uv_cond_signal(&b2->tokenProduced);
+    if (isFull(b2, count)) break;
+    if (pts) { // fill the contiguous run of free slots, publish once
+      size_t n = b2->sharedBuffer_size - (count - b2->consumeCountCached),
+             m = slotsToEnd(b2, count);
+      if ((n = pts(&b2->sharedBuffer[count % b2->sharedBuffer_size],
+              n < m ? n : m, b2))) publishProduced(b2, count += n);
+      continue;
     }
-    uv_mutex_unlock(&b2->tokenProducedMutex);
+    pt(&b2->sharedBuffer[count % b2->sharedBuffer_size], b2);
+    publishProduced(b2, ++count);
+  }
+}
+
+// Sleep until the consumer releases some of the sharedBuffer, that is, until
+// consumeCount moves on from seen, or until the b2 is closed.
+void waitForRelease (struct B2 * b2, unsigned int seen) {
+  if (spinWait(b2, &b2->consumeCount, seen)) return;
+  uv_mutex_lock(&b2->tokenConsumedMutex);
+  atomic_store_explicit(&b2->producerSleeping, true, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  while (b2->isOpen && b2->consumeCount == seen)
+    uv_cond_wait(&b2->tokenConsumed, &b2->tokenConsumedMutex);
+  atomic_store_explicit(&b2->producerSleeping, false, memory_order_relaxed);
+  uv_mutex_unlock(&b2->tokenConsumedMutex);
+}
+
+// The slot at the producer's end of the sharedBuffer, or NULL if it is full.
+// The token becomes visible to the consumer on commitToken.
+TokenType* reserveToken (struct B2 * b2) {
+  unsigned int count =
+    atomic_load_explicit(&b2->produceCount, memory_order_relaxed);
+
+  if (isFull(b2, count)) return NULL;
+  return &b2->sharedBuffer[count % b2->sharedBuffer_size];
+}
+
+void commitToken (struct B2 * b2) {
+  publishProduced(b2,
+      atomic_load_explicit(&b2->produceCount, memory_order_relaxed) + 1);
+}
+
+// Room for a record with size bytes of theMessage at the producer's end of
+// the sharedBuffer, or NULL if there is not enough of it. The record becomes
+// visible to the consumer on commitRecord.
+RecordType* tryReserveRecord (struct B2 * b2, size_t size) {
+  char* ring = (char*)b2->sharedBuffer;
+  size_t capacity = b2->sharedBuffer_size, span = recordSpan(size);
+  unsigned int count =
+    atomic_load_explicit(&b2->produceCount, memory_order_relaxed);
+  size_t offset = count & (capacity - 1), toEnd = capacity - offset;
+  size_t need = toEnd < span ? toEnd + span : span;
+  RecordType* r;
+
+  assert(span <= capacity / 2);
+  if (need > capacity - (count - b2->consumeCountCached)) {
+    b2->consumeCountCached =
+      atomic_load_explicit(&b2->consumeCount, memory_order_acquire);
+    if (need > capacity - (count - b2->consumeCountCached)) return NULL;
+  }
+  if (toEnd >= span) r = (RecordType*)(ring + offset);
+  else {
+    ((RecordType*)(ring + offset))->size = RECORD_WRAP;
+    r = (RecordType*)ring;
+  }
+  r->source = 0;
+  return r;
+}
+
+// Like tryReserveRecord, but wait for the consumer to release enough of the
+// sharedBuffer. Returns NULL if the b2 is closed while waiting.
+RecordType* reserveRecord (struct B2 * b2, size_t size) {
+  RecordType* r;
+
+  while ((r = tryReserveRecord(b2, size)) == NULL) {
+    waitForRelease(b2, b2->consumeCountCached);
+    if (!b2->isOpen) return NULL;
+  }
+  return r;
+}
+
+void commitRecord (struct B2 * b2, RecordType* r) {
+  char* ring = (char*)b2->sharedBuffer;
+  size_t capacity = b2->sharedBuffer_size;
+  unsigned int count =
+    atomic_load_explicit(&b2->produceCount, memory_order_relaxed);
+  size_t offset = count & (capacity - 1);
+
+  if ((char*)r != ring + offset) count += capacity - offset; // wrapped
+  publishProduced(b2, count + recordSpan(r->size));
+}
+
+static inline struct PoolNode* poolNode (struct TokenPool* p, uint32_t i) {
+  if (i < p->size) return &p->slab[0][i];
+  i -= p->size;
+  return &p->slab[1 + i / p->growth][i % p->growth];
+}
+
+static inline struct PoolNode* nodeOf (TokenType* tt) {
+  return (struct PoolNode*)((char*)tt - offsetof(struct PoolNode, token));
+}
+
+// Push the chain of free nodes from first to last on the free stack.
+static void poolPush (struct TokenPool* p, struct PoolNode* first,
+    struct PoolNode* last) {
+  uint64_t top = atomic_load_explicit(&p->top, memory_order_relaxed);
+
+  do __atomic_store_n(&last->next, (uint32_t)top, __ATOMIC_RELAXED);
+  while (!atomic_compare_exchange_weak_explicit(&p->top, &top,
+        ((top >> 32) + 1) << 32 | (first->index + 1),
+        memory_order_release, memory_order_relaxed));
+}
+
+// Add the slab of n nodes, numbered from base, to the free stack.
+static void poolSlab (struct TokenPool* p, uint32_t base, uint32_t n) {
+  struct PoolNode* slab = malloc(sizeof(struct PoolNode) * n);
+  uint32_t i;
+
+  assert(slab);
+  for (i = 0; i < n; i++) {
+    slab[i].index = base + i;
+    slab[i].next = i + 1 < n ? base + i + 2 : 0;
   }
+  p->slab[p->slabs++] = slab;
+  poolPush(p, &slab[0], &slab[n - 1]);
+}
+
+void poolInit (struct TokenPool* p, uint32_t size, uint32_t growth) {
+  memset(p, 0, sizeof(*p));
+  p->size = size ? size : 1;
+  p->growth = growth;
+  assert(uv_mutex_init(&p->growing) == 0);
+  poolSlab(p, 0, p->size);
+}
+
+// A free node of the pool, growing it if there is none; NULL if it cannot
+// grow anymore.
+TokenType* poolAlloc (struct TokenPool* p) {
+  uint64_t top = atomic_load_explicit(&p->top, memory_order_acquire);
+  struct PoolNode* node;
+
+  for (;;) {
+    while ((uint32_t)top) {
+      node = poolNode(p, (uint32_t)top - 1);
+      if (atomic_compare_exchange_weak_explicit(&p->top, &top,
+            ((top >> 32) + 1) << 32 |
+            __atomic_load_n(&node->next, __ATOMIC_RELAXED),
+            memory_order_acquire, memory_order_acquire))
+        return &node->token;
+    }
+    uv_mutex_lock(&p->growing);
+    top = atomic_load_explicit(&p->top, memory_order_acquire);
+    if ((uint32_t)top == 0) { // still empty
+      if (p->growth == 0 || p->slabs == POOL_SLABS) {
+        uv_mutex_unlock(&p->growing);
+        return NULL;
+      }
+      poolSlab(p, p->size + (p->slabs - 1) * p->growth, p->growth);
+      top = atomic_load_explicit(&p->top, memory_order_acquire);
+    }
+    uv_mutex_unlock(&p->growing);
+  }
+}
+
+void poolFree (struct TokenPool* p, TokenType* tt) {
+  struct PoolNode* node = nodeOf(tt);
+
+  poolPush(p, node, node);
+}
+
+// Whether the node t is one of the pool, rather than a record.
+bool poolOwns (struct TokenPool* p, void* t) {
+  unsigned int i;
+
+  for (i = 0; i < p->slabs; i++)
+    if ((char*)t >= (char*)p->slab[i] && (char*)t < (char*)(p->slab[i] +
+          (i ? p->growth : p->size))) return true;
+  return false;
+}
+
+void poolExit (struct TokenPool* p) {
+  unsigned int i;
+
+  for (i = 0; i < p->slabs; i++) free(p->slab[i]);
+  uv_mutex_destroy(&p->growing);
+}
+
+// Pin the calling thread to the CPUs of o, switch it to SCHED_FIFO and name
+// it. A setting the system refuses (SCHED_FIFO needs CAP_SYS_NICE or an
+// RLIMIT_RTPRIO) is reported and skipped.
+void applyThreadOptions (struct ThreadOptions* o) {
+#ifdef __gnu_linux__
+  struct sched_param param = { o->priority };
+  cpu_set_t cpus;
+  bool pinned = false;
+  int i, rc;
+
+  CPU_ZERO(&cpus);
+  for (i = 0; i < THREAD_CPUS; i++)
+    if (o->cpus[i / 64] & 1ull << (i % 64)) {
+      CPU_SET(i, &cpus);
+      pinned = true;
+    }
+  if (pinned && (rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus),
+          &cpus)))
+    fprintf(stderr, "applyThreadOptions %s affinity: %s\n", o->name,
+        strerror(rc));
+  if (o->priority && (rc = pthread_setschedparam(pthread_self(), SCHED_FIFO,
+          &param)))
+    fprintf(stderr, "applyThreadOptions %s SCHED_FIFO %d: %s\n", o->name,
+        o->priority, strerror(rc));
+  if (o->name[0]) pthread_setname_np(pthread_self(), o->name);
+#elif defined(__APPLE__)
+  if (o->name[0]) pthread_setname_np(o->name);
+#endif
 }
 
 void produceTokens (void* data) {
   struct B2 * b2 = (struct B2 *) data;
-  
+  napi_threadsafe_function onDrain = b2->producer.onDrain; // see B2T_Open
+
+  applyThreadOptions(&b2->producer.thread);
   (*b2->producer.initOnOpen)(b2);
   while (b2->isOpen) {
+    if (b2->producer.produce) { // it reserves and commits by itself
+      (*b2->producer.produce)(b2);
+      continue;
+    }
     producer(b2);
-    if (b2->produceCount - b2->consumeCount == b2->sharedBuffer_size) {
+    if (b2->produceCount - b2->consumeCount == b2->sharedBuffer_size &&
+        !spinWait(b2, &b2->consumeCount,
+          b2->produceCount - b2->sharedBuffer_size)) {
 #ifdef DEBUG_PRINTF
-      printf("produceTokens sid %d, sharedBuffer full, produceCount %u\n", 
+      printf("produceTokens sid %d, sharedBuffer full, produceCount %u\n",
           b2->b2t_this.sid, b2->produceCount);
 #endif
       uv_mutex_lock(&b2->tokenConsumedMutex);
+      atomic_store_explicit(&b2->producerSleeping, true, memory_order_relaxed);
+      atomic_thread_fence(memory_order_seq_cst);
 
       // sharedBuffer is full
       while (b2->isOpen &&
           b2->produceCount - b2->consumeCount == b2->sharedBuffer_size)
         uv_cond_wait(&b2->tokenConsumed, &b2->tokenConsumedMutex);
+      atomic_store_explicit(&b2->producerSleeping, false, memory_order_relaxed);
       uv_mutex_unlock(&b2->tokenConsumedMutex);
     }
   }
   (*b2->producer.cleanupOnClose)(b2);
+  if (onDrain)
+    assert(napi_ok == napi_release_threadsafe_function(onDrain,
+          napi_tsfn_release));
 }
 
 static void consumer (struct B2 * b2) {
   void (*ct) (TokenType* tt, struct B2 * b2) = b2->consumer.consumeToken;
+  size_t (*cts) (TokenType* slots, size_t n, struct B2 * b2) =
+    b2->consumer.consumeTokens;
+  unsigned int count =
+    atomic_load_explicit(&b2->consumeCount, memory_order_relaxed);
+
   while (b2->isOpen) {
-    if (b2->produceCount == b2->consumeCount) // sharedBuffer is empty
-      break;
-    ct(&b2->sharedBuffer[b2->consumeCount % b2->sharedBuffer_size], b2);
-    uv_mutex_lock(&b2->tokenConsumedMutex);
-    if (b2->produceCount - b2->consumeCount++ == b2->sharedBuffer_size) {
-      uv_cond_signal(&b2->tokenConsumed);
+    if (isEmpty(b2, count)) break;
+    if (cts) { // drain the contiguous run of produced slots, publish once
+      size_t n = b2->produceCountCached - count, m = slotsToEnd(b2, count);
+      if ((n = cts(&b2->sharedBuffer[count % b2->sharedBuffer_size],
+              n < m ? n : m, b2))) publishConsumed(b2, count += n);
+      continue;
     }
-    uv_mutex_unlock(&b2->tokenConsumedMutex);
+    ct(&b2->sharedBuffer[count % b2->sharedBuffer_size], b2);
+    publishConsumed(b2, ++count);
+  }
+}
+
+// The record at the consumer's end of the sharedBuffer, or NULL if it is empty.
+static inline RecordType* peekRecord (struct B2 * b2) {
+  char* ring = (char*)b2->sharedBuffer;
+  unsigned int count =
+    atomic_load_explicit(&b2->consumeCount, memory_order_relaxed);
+  RecordType* r;
+
+  if (isEmpty(b2, count)) return NULL;
+  r = (RecordType*)(ring + (count & (b2->sharedBuffer_size - 1)));
+  return r->size == RECORD_WRAP ? (RecordType*)ring : r;
+}
+
+// The consumeCount of record r, the one peekRecord returned.
+static inline unsigned int recordCount (struct B2 * b2, RecordType* r) {
+  char* ring = (char*)b2->sharedBuffer;
+  size_t capacity = b2->sharedBuffer_size;
+  unsigned int count =
+    atomic_load_explicit(&b2->consumeCount, memory_order_relaxed);
+  size_t offset = count & (capacity - 1);
+
+  return (char*)r == ring + offset ? count : count + capacity - offset;
+}
+
+// Release n records of the contiguous run starting with r.
+static inline void releaseRecords (struct B2 * b2, RecordType* r, size_t n) {
+  unsigned int count = recordCount(b2, r);
+
+  while (n--) {
+    count += recordSpan(r->size);
+    r = nextRecord(r);
+  }
+  publishConsumed(b2, count);
+}
+
+// The number of produced records in the contiguous run starting with r.
+static inline size_t recordsInRun (struct B2 * b2, RecordType* r) {
+  char* end = (char*)b2->sharedBuffer + b2->sharedBuffer_size;
+  unsigned int count = recordCount(b2, r);
+  size_t n = 0;
+
+  while (count != b2->produceCountCached && (char*)r < end &&
+      r->size != RECORD_WRAP) {
+    count += recordSpan(r->size);
+    r = nextRecord(r);
+    n++;
+  }
+  return n;
+}
+
+static void recordConsumer (struct B2 * b2) {
+  void (*cr) (RecordType* r, struct B2 * b2) = b2->consumer.consumeRecord;
+  size_t (*crs) (RecordType* r, size_t n, struct B2 * b2) =
+    b2->consumer.consumeRecords;
+  RecordType* r;
+  size_t n;
+
+  while (b2->isOpen && (r = peekRecord(b2))) {
+    if (crs) { // drain the contiguous run of produced records, publish once
+      if ((n = crs(r, recordsInRun(b2, r), b2))) releaseRecords(b2, r, n);
+      continue;
+    }
+    cr(r, b2);
+    releaseRecords(b2, r, 1);
   }
 }
 
 void consumeTokens (void* data) {
   struct B2 * b2 = (struct B2 *) data;
 
+  applyThreadOptions(&b2->consumer.thread);
   (*b2->consumer.initOnOpen)(b2);
   while (b2->isOpen) {
-    consumer(b2);
-    if (b2->produceCount == b2->consumeCount) { // sharedBuffer is empty
+    if (b2->records) recordConsumer(b2);
+    else consumer(b2);
+    if (b2->produceCount == b2->consumeCount && // sharedBuffer is empty
+        !spinWait(b2, &b2->produceCount, b2->consumeCount)) {
 #ifdef DEBUG_PRINTF
-      printf("consumeTokens sid %d, sharedBuffer empty, consumeCount %u\n", 
+      printf("consumeTokens sid %d, sharedBuffer empty, consumeCount %u\n",
           b2->b2t_this.sid, b2->consumeCount);
 #endif
       uv_mutex_lock(&b2->tokenProducedMutex);
+      atomic_store_explicit(&b2->consumerSleeping, true, memory_order_relaxed);
+      atomic_thread_fence(memory_order_seq_cst);
       while (b2->isOpen && b2->produceCount == b2->consumeCount)
         uv_cond_wait(&b2->tokenProduced, &b2->tokenProducedMutex);
+      atomic_store_explicit(&b2->consumerSleeping, false, memory_order_relaxed);
       uv_mutex_unlock(&b2->tokenProducedMutex);
     }
   }
   (*b2->consumer.cleanupOnClose)(b2);
 }
+
+// The contiguous run of produced tokens (records) at the consumer's end of
+// the sharedBuffer, with their number in n, or NULL if it is empty. The loop
+// consumer drains the sharedBuffer with peekRun and releaseRun on the main
+// thread, instead of a consumer thread.
+void* peekRun (struct B2 * b2, size_t* n) {
+  unsigned int count =
+    atomic_load_explicit(&b2->consumeCount, memory_order_relaxed);
+  RecordType* r;
+  size_t m;
+
+  if (b2->records) {
+    if ((r = peekRecord(b2)) == NULL) return NULL;
+    *n = recordsInRun(b2, r);
+    return r;
+  }
+  if (isEmpty(b2, count)) return NULL;
+  *n = b2->produceCountCached - count;
+  if (*n > (m = slotsToEnd(b2, count))) *n = m;
+  return &b2->sharedBuffer[count % b2->sharedBuffer_size];
+}
+
+// Release n tokens (records) of the run starting with first.
+void releaseRun (struct B2 * b2, void* first, size_t n) {
+  if (b2->records) releaseRecords(b2, first, n);
+  else publishConsumed(b2,
+      atomic_load_explicit(&b2->consumeCount, memory_order_relaxed) + n);
+}
+
+// Ask the producer to signal consumer.notifyFd on its next publish. Returns
+// false if there are produced tokens already, the caller then drains them
+// rather than waiting; the fence pairs with the one in publishProduced.
+bool awaitProduced (struct B2 * b2) {
+  unsigned int count =
+    atomic_load_explicit(&b2->consumeCount, memory_order_relaxed);
+
+  atomic_store_explicit(&b2->consumerSleeping, true, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&b2->produceCount, memory_order_relaxed) == count)
+    return true;
+  atomic_store_explicit(&b2->consumerSleeping, false, memory_order_relaxed);
+  return false;
+}
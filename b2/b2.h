@@ -1,7 +1,12 @@
 #ifndef B2_H
 #define B2_H
 
+#define _GNU_SOURCE // splice
+
 #include <assert.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
@@ -9,10 +14,15 @@
 #include <uv.h>
 #include <node_api.h>
 #include <sys/time.h>
+#include "udp.h"
 #ifdef __gnu_linux__
 #include <sys/epoll.h>
 #endif
 
+// The cache line size used to keep the producer-owned and the consumer-owned
+// parts of a struct B2 apart.
+#define B2_CACHELINE 64
+
 struct fifo {
   struct fifo* in;
   struct fifo* out;
@@ -34,6 +44,9 @@ static inline struct fifo* fifoOut (struct fifo* q) {
 static inline bool fifoEmpty (struct fifo* q) {
   return q->size == 0;
 }
+static inline struct fifo* fifoPeek (struct fifo* q) {
+  return q->size == 0 ? NULL : q->out;
+}
 // For any given element t of the non-empty fifo queue q,
 //
 //   t->sid + 1 == t->out->sid AND
@@ -41,13 +54,156 @@ static inline bool fifoEmpty (struct fifo* q) {
 //   q->in->sid > t->sid if q->in != t
 //
 
+static inline void cpuRelax (void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+// The queue of the tokens to produce, a multi-producer single-consumer
+// intrusive queue after Dmitry Vyukov: any thread pushes a node with one
+// atomic exchange and no lock, only the producer thread pops (a file writer's
+// consumer thread pops its initToken on close, see reportWritten). The out
+// link of a node points to the node pushed after it, and in is the last node
+// pushed. The sid orders the nodes of each pushing thread; mpscSid draws it.
+//
+// A push is visible to mpscEmpty once linked. Between the exchange and the
+// link, mpscPeek may find no node while the size says there is one: the
+// popping thread then retries.
+struct mpsc {
+  _Alignas(B2_CACHELINE) _Atomic(struct fifo*) in; // the pushing threads
+  atomic_uint sid;
+  atomic_size_t size; // of the linked nodes, the peeked one included
+  atomic_bool sleeping; // the popping thread waits for a push, see pushToken
+  _Alignas(B2_CACHELINE) struct fifo* out; // the popping thread
+  struct fifo* front; // peeked, not popped yet
+  struct fifo stub;
+};
+static inline void mpscInit (struct mpsc* q) {
+  q->stub.out = NULL;
+  atomic_init(&q->in, &q->stub);
+  atomic_init(&q->sid, 0);
+  atomic_init(&q->size, 0);
+  atomic_init(&q->sleeping, false);
+  q->out = &q->stub;
+  q->front = NULL;
+}
+static inline unsigned int mpscSid (struct mpsc* q) {
+  return atomic_fetch_add_explicit(&q->sid, 1, memory_order_relaxed);
+}
+static inline void mpscLink (struct mpsc* q, struct fifo* t) {
+  struct fifo* prev;
+
+  __atomic_store_n(&t->out, NULL, __ATOMIC_RELAXED);
+  prev = atomic_exchange_explicit(&q->in, t, memory_order_acq_rel);
+  __atomic_store_n(&prev->out, t, __ATOMIC_RELEASE);
+}
+// Push the node t, its sid set by the caller.
+static inline void mpscPush (struct mpsc* q, struct fifo* t) {
+  mpscLink(q, t);
+  atomic_fetch_add_explicit(&q->size, 1, memory_order_seq_cst);
+}
+static inline bool mpscEmpty (struct mpsc* q) {
+  return atomic_load_explicit(&q->size, memory_order_seq_cst) == 0;
+}
+// The node to pop next, or NULL; the popping thread only.
+static inline struct fifo* mpscPeek (struct mpsc* q) {
+  struct fifo* tail = q->out, * next;
+
+  if (q->front) return q->front;
+  next = __atomic_load_n(&tail->out, __ATOMIC_ACQUIRE);
+  if (tail == &q->stub) { // skip the stub
+    if (next == NULL) return NULL;
+    q->out = tail = next;
+    next = __atomic_load_n(&tail->out, __ATOMIC_ACQUIRE);
+  }
+  if (next == NULL) { // tail is the last node, unless a push is linking
+    if (tail != atomic_load_explicit(&q->in, memory_order_acquire))
+      return NULL;
+    mpscLink(q, &q->stub); // so that tail can be unlinked
+    if ((next = __atomic_load_n(&tail->out, __ATOMIC_ACQUIRE)) == NULL)
+      return NULL;
+  }
+  q->out = next;
+  return q->front = tail;
+}
+static inline struct fifo* mpscPop (struct mpsc* q) {
+  struct fifo* t = mpscPeek(q);
+
+  if (t) {
+    q->front = NULL;
+    atomic_fetch_sub_explicit(&q->size, 1, memory_order_seq_cst);
+  }
+  return t;
+}
+
 // The data in the shared buffer.
 typedef struct {
   struct fifo tt_this;
   char theMessage[128];
   long long int theDelay;
+  int source; // the socket the netReader received theMessage from, or 0
+  unsigned int length; // of theMessage, by send() and sendBuffer()
 } TokenType;
 
+// The data in the shared buffer of a b2 in the record mode. Each record is
+// a header followed by size bytes of theMessage and a '\0', padded to 8 bytes
+// and packed contiguously into the sharedBuffer. A record that does not fit
+// before the end of the sharedBuffer is written at its start, and the gap is
+// marked with size == RECORD_WRAP.
+typedef struct {
+  unsigned int sid;
+  unsigned int size; // of theMessage, in bytes
+  long long int theDelay;
+  int source; // see TokenType
+  char theMessage[];
+} RecordType;
+#define RECORD_WRAP 0xffffffffu
+#define RECORD_ALIGN 8
+
+static inline size_t recordSpan (size_t size) {
+  return (sizeof(RecordType) + size + RECORD_ALIGN) &
+    ~(size_t)(RECORD_ALIGN - 1); // with the '\0', see Layout
+}
+
+// The record following r in a contiguous run of records.
+static inline RecordType* nextRecord (RecordType* r) {
+  return (RecordType*)((char*)r + recordSpan(r->size));
+}
+
+// The theMessage of a token produced by the mmapFileReader: a line of the
+// mapped file, in place.
+typedef struct {
+  size_t offset, size;
+} TokenRef;
+
+// The pool of the TokenType nodes of tokens2produce: slab 0 of size nodes,
+// allocated by newB2native, and up to POOL_SLABS - 1 more slabs of growth
+// nodes each, allocated when the pool runs out. The free nodes form a stack
+// any thread pushes to and pops from with a compare-and-swap of top, the
+// index of the first free node tagged against ABA; a node is found by its
+// index, so the slabs are only freed with the b2. Records are not pooled.
+#define POOL_SLABS 256
+struct PoolNode {
+  uint32_t next; // 1 + the index of the next free node, 0 if none
+  uint32_t index;
+  TokenType token;
+};
+struct TokenPool {
+  _Alignas(B2_CACHELINE) _Atomic uint64_t top; // the tag, 1 + the index
+  uv_mutex_t growing;
+  uint32_t size, growth; // 0 growth: the pool does not grow
+  unsigned int slabs;
+  struct PoolNode* slab[POOL_SLABS];
+};
+
+// The record queued in a tokens2produce node of a b2 in the record mode.
+static inline RecordType* fifoRecord (struct fifo* t) {
+  return (RecordType*)(t + 1);
+}
+
 // The data associated with an instance of the module. This takes the place of
 // global static variables, while allowing multiple instances of the module to
 // co-exist.
@@ -58,22 +214,111 @@ typedef struct {
   napi_ref ct_constructor;  // ConsumerType
   napi_ref tt_constructor; // RESTRICTION: even though this implementation supports
   // multiple b2 instances, they all must operate on the same TokenType.
+  napi_ref rt_constructor; // RecordType
 } ModuleData;
 
 struct B2;
 
+// How a thread waits on a full (the producer) or an empty (the consumer)
+// sharedBuffer: it parks on the condvar at once (block), spins with the CPU
+// relaxed (spin), spins spinBudget times and then yields the CPU on each
+// check (yield), or spins spinBudget times and then parks (spinPark).
+enum WaitStrategy { WAIT_BLOCK, WAIT_SPIN, WAIT_YIELD, WAIT_SPIN_PARK };
+
+// The placement and the scheduling of a producer or a consumer thread; the
+// thread applies them at its start, see applyThreadOptions.
+#define THREAD_CPUS 1024
+struct ThreadOptions {
+  uint64_t cpus[THREAD_CPUS / 64]; // the affinity mask, none: any CPU
+  int priority; // SCHED_FIFO priority, 0 keeps the default policy
+  char name[16]; // of the thread
+};
+
+// The batch variants produceTokens/consumeTokens, when not NULL, are used
+// instead of produceToken/consumeToken. They get a contiguous run of n free
+// (produced) slots, fill (drain) as many of them as they can and return that
+// number; the counter is then published once for the whole run. A batch
+// variant returns 0 when the b2 is being closed, or when it has to be called
+// again with a longer run (see consumer_consumeTokens_window).
+//
+// In the record mode, produce/consumeRecord(s) are used instead; the batch
+// variant consumeRecords gets a contiguous run of n records (see nextRecord).
+// produce reserves and commits the sharedBuffer space by itself (see
+// reserveRecord); it is also used by the producers that share the
+// sharedBuffer with the main thread (the direct sender) in either mode.
+//
+// openSockets, when not NULL, binds (connects) the sockets of a network
+// producer or consumer (or opens the file of a file reader, maps that of the
+// mmapFileReader, opens the sink of the epollFileWriter) on the main thread,
+// before B2T_Open starts the threads; it returns -1 and the error for
+// JavaScript when it fails.
 struct Producer {
-  struct fifo tokens2produce;
+  struct mpsc tokens2produce;
+  struct TokenPool pool; // of the tokens2produce nodes
   void (*initOnOpen) (struct B2 *);
   void (*cleanupOnClose) (struct B2 *);
   void (*produceToken) (TokenType* tt, struct B2 * b2);
+  size_t (*produceTokens) (TokenType* slots, size_t n, struct B2 * b2);
+  void (*produce) (struct B2 * b2);
+  int (*openSockets) (struct B2 *, char* error, size_t errorSize);
+  struct ThreadOptions thread;
+  bool direct; // the main thread produces into the sharedBuffer, too
+  bool refs; // theMessage of a token is a TokenRef, see tokenMessage
+  void* source; // the chunk buffers (and the fds) of a file reader
+  int file; // opened by openSockets for the initOnOpen of a file reader, or 0
+  const char* mapped; // the file mapped by the mmapFileReader
+  size_t mappedSize;
+  int wakeFd; // the eventfd B2T_Close signals to wake a polling producer, or 0;
+              // the b2's from newB2native to Finalize
+  size_t highWaterMark; // send() returns false with this many tokens queued
+  size_t lowWaterMark; // and 'drain' follows once at most this many are
+  atomic_bool needDrain; // a send() has returned false, see PT_Send
+  napi_ref drainListener; // the 'drain' JavaScript function, or 0
+  napi_threadsafe_function onDrain; // of drainListener, from open to close
+};
+
+// What the TokenType object of a sharedBuffer slot wraps, see wrapToken.
+struct TokenSlot {
+  TokenType* token;
+  struct B2 * b2;
 };
 
 struct Consumer {
   napi_threadsafe_function onToken;
+  napi_ref* wrappers; // of the sharedBuffer slots, NULL in the record mode
+  struct TokenSlot* slots; // what they wrap
+  napi_ref buffer; // the ArrayBuffer of consumer.buffer, see b2ArrayBuffer
+  napi_ref counts[2]; // those of the produceCount and the consumeCount
+  napi_ref indices; // the array of their Uint32Arrays, consumer.indices
+  bool batches; // deliver the 'tokens' event rather than 'token'
+  bool runs; // deliver the 'run' event, the tokens are read in place
+  atomic_size_t batchSize; // of the batch passed to the 'tokens' JavaScript
+                           // function, published to CT_Release
+  atomic_size_t released; // by the 'run' JavaScript function, see CT_Release
+  bool running; // CallJs_onRun is calling it, CT_Release signals after it
+  void* sink; // the output buffer (and the fds) of a file writer
+  size_t flushThreshold; // of the bioFileWriter output buffer, in bytes
+  size_t window; // max tokens passed to the 'token' function, not yet done with
+  size_t inFlight; // such tokens at the start of the run, consumer thread only
   void (*initOnOpen) (struct B2 *);
   void (*cleanupOnClose) (struct B2 *);
+  int (*openSockets) (struct B2 *, char* error, size_t errorSize);
+  int wakeFd; // the eventfd B2T_Close signals to wake a polling consumer, or 0;
+              // the b2's from newB2native to Finalize
+  struct ThreadOptions thread;
+  bool loop; // no consumer thread, the main thread drains the sharedBuffer
+  int notifyFd; // the eventfd of the loop consumer, or 0, see publishProduced
+  uv_poll_t* poll; // of notifyFd on the event loop
+  napi_env env; // of the 'run' ('readable') function of the loop consumer
+  napi_ref onRun; // that function
+  bool pulls; // onRun is the 'readable' function, see CT_Pull
+  napi_async_context context; // of its calls
+  void* run; // the first token of the run passed to it, or NULL
+  bool draining; // the main thread is in drainOnLoop
   void (*consumeToken) (TokenType* tt, struct B2 * b2);
+  size_t (*consumeTokens) (TokenType* slots, size_t n, struct B2 * b2);
+  void (*consumeRecord) (RecordType* r, struct B2 * b2);
+  size_t (*consumeRecords) (RecordType* r, size_t n, struct B2 * b2);
 };
 
 struct B2 {
@@ -87,9 +332,26 @@ struct B2 {
   struct Producer producer;
   struct Consumer consumer;
   volatile bool isOpen;
-  volatile unsigned int produceCount, consumeCount;
-  size_t sharedBuffer_size;
-  TokenType sharedBuffer[];
+  bool started; // B2T_Open has started the threads, see Finalize
+  bool records; // the record mode
+  enum WaitStrategy wait;
+  unsigned int spinBudget; // of WAIT_YIELD and WAIT_SPIN_PARK, in checks
+  struct UdpOptions udp; // of the sockets, see openSockets
+  size_t sharedBuffer_size; // in slots, or in bytes in the record mode
+
+  // The single-producer/single-consumer ring indices. Each thread owns the
+  // cache line with its own counter and a cached copy of the other thread's
+  // counter; it only reloads the other counter when the cached copy says the
+  // sharedBuffer is full (producer) or empty (consumer).
+  _Alignas(B2_CACHELINE) atomic_uint produceCount;
+  unsigned int consumeCountCached; // producer thread only
+  _Alignas(B2_CACHELINE) atomic_uint consumeCount;
+  unsigned int produceCountCached; // consumer thread only
+
+  // Set by a thread that is about to sleep on its condvar, so that the other
+  // thread takes the mutex and signals only when there is a sleeper.
+  _Alignas(B2_CACHELINE) atomic_bool producerSleeping, consumerSleeping;
+  _Alignas(B2_CACHELINE) TokenType sharedBuffer[];
 };
 
 static inline bool is_undefined (napi_env env, napi_value v) {
@@ -142,6 +404,115 @@ static inline uint32_t uint32 (napi_env env, napi_value unsignedInt) {
   return result;
 }
 
+// Get the named property of the options object passed to newB2, or NULL
+// if options is undefined or does not have the property.
+static inline napi_value option (napi_env env, napi_value options,
+    const char* name) {
+  bool has;
+  napi_value result;
+  if (options == NULL || is_undefined(env, options)) return NULL;
+  assert(napi_ok == napi_has_named_property(env, options, name, &has));
+  if (!has) return NULL;
+  assert(napi_ok == napi_get_named_property(env, options, name, &result));
+  return result;
+}
+
+static inline bool optionBool (napi_env env, napi_value options,
+    const char* name) {
+  bool result = false;
+  napi_value v = option(env, options, name);
+  if (v) {
+    assert(napi_ok == napi_coerce_to_bool(env, v, &v));
+    assert(napi_ok == napi_get_value_bool(env, v, &result));
+  }
+  return result;
+}
+
+static inline uint32_t optionUint32 (napi_env env, napi_value options,
+    const char* name, uint32_t byDefault) {
+  napi_value v = option(env, options, name);
+  return v ? uint32(env, v) : byDefault;
+}
+
+// Read the named option, a CPU number or an array of them, into the mask o.
+// Returns false if a CPU is out of range.
+static inline bool optionCpus (napi_env env, napi_value options,
+    const char* name, struct ThreadOptions* o) {
+  napi_value v = option(env, options, name), cpu;
+  uint32_t i, n = 1, c;
+  bool isArray;
+
+  if (v == NULL) return true;
+  assert(napi_ok == napi_is_array(env, v, &isArray));
+  if (isArray) assert(napi_ok == napi_get_array_length(env, v, &n));
+  for (i = 0; i < n; i++) {
+    if (isArray) assert(napi_ok == napi_get_element(env, v, i, &cpu));
+    if ((c = uint32(env, isArray ? cpu : v)) >= THREAD_CPUS) return false;
+    o->cpus[c / 64] |= 1ull << (c % 64);
+  }
+  return true;
+}
+
+// Read the named string option into the size bytes of result, truncating it;
+// result is left as it is if there is no such option.
+static inline void optionString (napi_env env, napi_value options,
+    const char* name, char* result, size_t size) {
+  napi_value v = option(env, options, name);
+  size_t length;
+
+  if (v) assert(napi_ok == napi_get_value_string_utf8(env, v, result, size,
+        &length));
+}
+
+// The token (a TokenType or a RecordType) that follows t in the run.
+static inline void* nextToken (struct B2 * b2, void* t) {
+  return b2->records ? (void*)nextRecord(t) : (void*)((TokenType*)t + 1);
+}
+
+static inline long long int* delayOf (struct B2 * b2, void* t) {
+  return b2->records ? &((RecordType*)t)->theDelay : &((TokenType*)t)->theDelay;
+}
+
+// The message of the slot token tt and its size, in place.
+static inline const char*
+tokenMessage (struct B2 * b2, TokenType* tt, size_t* size) {
+  TokenRef* ref = (TokenRef*)tt->theMessage;
+
+  if (!b2->producer.refs) {
+    *size = strlen(tt->theMessage);
+    return tt->theMessage;
+  }
+  *size = ref->size;
+  return b2->producer.mapped + ref->offset;
+}
+
+// The length of the mapping of the mmapFileReader; an empty file is mapped
+// a page long, as mmap does not map zero bytes.
+static inline size_t mappedLength (struct B2 * b2) {
+  return b2->producer.mappedSize ? b2->producer.mappedSize : 1;
+}
+
+// The largest theMessage a record can carry; records up to half the
+// sharedBuffer always fit, however the wrap gap falls.
+static inline size_t recordSizeMax (struct B2 * b2) {
+  return b2->sharedBuffer_size / 2 - sizeof(RecordType) - 8;
+}
+
+void waitForRelease (struct B2 * b2, unsigned int seen);
+TokenType* reserveToken (struct B2 * b2);
+void commitToken (struct B2 * b2);
+RecordType* tryReserveRecord (struct B2 * b2, size_t size);
+RecordType* reserveRecord (struct B2 * b2, size_t size);
+void commitRecord (struct B2 * b2, RecordType* r);
+void poolInit (struct TokenPool* p, uint32_t size, uint32_t growth);
+TokenType* poolAlloc (struct TokenPool* p);
+void poolFree (struct TokenPool* p, TokenType* tt);
+bool poolOwns (struct TokenPool* p, void* t);
+void poolExit (struct TokenPool* p);
+void applyThreadOptions (struct ThreadOptions* o);
+void* peekRun (struct B2 * b2, size_t* n);
+void releaseRun (struct B2 * b2, void* first, size_t n);
+bool awaitProduced (struct B2 * b2);
 void produceTokens (void*);
 void consumeTokens (void*);
 
@@ -1,7 +1,12 @@
 #include "b2.h"
 #include "udp.h"
+#include "uring.h"
+#include <errno.h>
+#include <sys/mman.h>
 #ifdef __gnu_linux__
+#include <poll.h>
 #include <sys/eventfd.h>
+#include <sys/stat.h>
 #endif
 
 static inline long long int nowUs () {
@@ -25,6 +30,7 @@ static void FreeModuleData (napi_env env, void* data, void* hint) {
   assert(napi_ok == napi_delete_reference(env, md->pt_constructor));
   assert(napi_ok == napi_delete_reference(env, md->ct_constructor));
   assert(napi_ok == napi_delete_reference(env, md->tt_constructor));
+  assert(napi_ok == napi_delete_reference(env, md->rt_constructor));
   free(data);
 }
 
@@ -39,15 +45,49 @@ static inline void B2T_DestroyUVTH (struct B2 * b2) {
   uv_cond_destroy(&b2->tokenConsuming);
 }
 
-static void Finalize (struct B2 * b2) {
+// The external ArrayBuffer over the size bytes at data in the b2, created
+// once and kept in *ref; Finalize detaches it (see detachArrayBuffer), so
+// that it does not outlive the b2.
+static napi_value b2ArrayBuffer (napi_env env, void* data, size_t size,
+    napi_ref* ref) {
+  napi_value result;
+
+  if (*ref == NULL) {
+    assert(napi_ok == napi_create_external_arraybuffer(env, data, size, 0, 0,
+          &result));
+    assert(napi_ok == napi_create_reference(env, result, 1, ref));
+  }
+  else assert(napi_ok == napi_get_reference_value(env, *ref, &result));
+  return result;
+}
+
+static void detachArrayBuffer (napi_env env, napi_ref ref) {
+  napi_value arraybuffer;
+
+  if (ref == NULL) return;
+  assert(napi_ok == napi_get_reference_value(env, ref, &arraybuffer));
+  assert(napi_ok == napi_detach_arraybuffer(env, arraybuffer));
+  assert(napi_ok == napi_delete_reference(env, ref));
+}
+
+static void Finalize (napi_env env, struct B2 * b2) {
   ModuleData* md = b2->md;
+  napi_handle_scope scope;
+  napi_value wrapper;
+  size_t i;
 #ifdef DEBUG_PRINTF
   unsigned int sid = b2->b2t_this.sid;
 #endif
 
-  // Wait until the producer-consumer threads are stopped.
-  assert(uv_thread_join(&b2->producerThread) == 0);
-  assert(uv_thread_join(&b2->consumerThread) == 0);
+  // Wait until the producer-consumer threads are stopped, if a B2T_Open
+  // has got as far as starting them.
+  if (b2->started) {
+    assert(uv_thread_join(&b2->producerThread) == 0);
+    if (b2->consumer.loop) close(b2->consumer.notifyFd);
+    else assert(uv_thread_join(&b2->consumerThread) == 0);
+  }
+  if (b2->producer.wakeFd) assert(0 == close(b2->producer.wakeFd));
+  if (b2->consumer.wakeFd) assert(0 == close(b2->consumer.wakeFd));
 
   // Destroy the uv threading harness.
   B2T_DestroyUVTH(b2);
@@ -57,11 +97,35 @@ static void Finalize (struct B2 * b2) {
   struct fifo * q = &b2->b2t_this, * queue = &md->b2instances;
   struct fifo * p = q->out, * r = q->in;
   p->in = r; r->out = p; queue->size--;
-  while ((q = fifoOut(&b2->producer.tokens2produce))) {
+  while ((q = mpscPop(&b2->producer.tokens2produce))) {
 #ifdef DEBUG_PRINTF
     printf("Finalize sid %u, unproduced token sid %u\n", sid, q->sid);
 #endif
-    free(q);
+    if (!poolOwns(&b2->producer.pool, q)) free(q); // a record
+  }
+  poolExit(&b2->producer.pool);
+  if (b2->producer.mapped) // no token refers to it anymore
+    munmap((void*)b2->producer.mapped, mappedLength(b2));
+  assert(napi_ok == napi_open_handle_scope(env, &scope)); // see onPollClosed
+  detachArrayBuffer(env, b2->consumer.buffer);
+  detachArrayBuffer(env, b2->consumer.counts[0]);
+  detachArrayBuffer(env, b2->consumer.counts[1]);
+  assert(napi_ok == napi_close_handle_scope(env, scope));
+  if (b2->consumer.indices)
+    assert(napi_ok == napi_delete_reference(env, b2->consumer.indices));
+  if (b2->producer.drainListener)
+    assert(napi_ok == napi_delete_reference(env, b2->producer.drainListener));
+  if (b2->consumer.wrappers) { // the TokenType objects kept go stale
+    assert(napi_ok == napi_open_handle_scope(env, &scope));
+    for (i = 0; i < b2->sharedBuffer_size; i++) {
+      assert(napi_ok == napi_get_reference_value(env,
+            b2->consumer.wrappers[i], &wrapper));
+      assert(napi_ok == napi_remove_wrap(env, wrapper, NULL));
+      assert(napi_ok == napi_delete_reference(env, b2->consumer.wrappers[i]));
+    }
+    assert(napi_ok == napi_close_handle_scope(env, scope));
+    free(b2->consumer.wrappers);
+    free(b2->consumer.slots);
   }
   free(b2);
 #ifdef DEBUG_PRINTF
@@ -69,6 +133,81 @@ static void Finalize (struct B2 * b2) {
 #endif
 }
 
+// Pass the runs of produced tokens to the 'run' JavaScript function on the
+// main thread, until the sharedBuffer is empty or the function does not
+// release the run right away; CT_Release carries on with the draining then.
+// The 'readable' function is called with no argument instead: CT_Pull gets
+// the tokens. With no function, the tokens wait in the sharedBuffer.
+static void drainOnLoop (struct B2 * b2) {
+  struct Consumer* c = &b2->consumer;
+  napi_env env = c->env;
+  napi_handle_scope scope;
+  napi_value global, js_cb, argv[2], error;
+  long long int now;
+  size_t i, n;
+  void* t;
+
+  if (c->draining || c->onRun == NULL) return;
+  c->draining = true;
+  assert(napi_ok == napi_open_handle_scope(env, &scope));
+  assert(napi_ok == napi_get_global(env, &global));
+  assert(napi_ok == napi_get_reference_value(env, c->onRun, &js_cb));
+  if (c->pulls &&
+      napi_ok != napi_make_callback(env, c->context, global, js_cb, 0, NULL,
+        NULL)) {
+    assert(napi_ok == napi_get_and_clear_last_exception(env, &error));
+    assert(napi_ok == napi_fatal_exception(env, error));
+  }
+  while (!c->pulls && b2->isOpen && c->run == NULL) {
+    if ((c->run = peekRun(b2, &n)) == NULL) {
+      if (awaitProduced(b2)) break; // notifyFd will tell
+      continue;
+    }
+
+    // Set the consumer - producer delay of the tokens not passed yet.
+    now = nowUs();
+    for (i = 0, t = c->run; i < n; i++, t = nextToken(b2, t))
+      if (i >= c->inFlight) *delayOf(b2, t) = now - *delayOf(b2, t);
+    c->inFlight = c->batchSize = n;
+    assert(napi_ok == napi_create_uint32(env,
+          (char*)c->run - (char*)b2->sharedBuffer, &argv[0]));
+    assert(napi_ok == napi_create_uint32(env, n, &argv[1]));
+    if (napi_ok != napi_make_callback(env, c->context, global, js_cb, 2,
+          argv, NULL)) {
+      assert(napi_ok == napi_get_and_clear_last_exception(env, &error));
+      assert(napi_ok == napi_fatal_exception(env, error));
+      break;
+    }
+  }
+  assert(napi_ok == napi_close_handle_scope(env, scope));
+  c->draining = false;
+}
+
+#ifdef __gnu_linux__
+// The producer has signalled notifyFd: the sharedBuffer is no longer empty.
+static void onNotify (uv_poll_t* handle, int status, int events) {
+  struct B2 * b2 = handle->data;
+  uint64_t value;
+
+  if (read(b2->consumer.notifyFd, &value, sizeof(value)) == -1)
+    assert(errno == EAGAIN);
+  drainOnLoop(b2);
+}
+#endif
+
+// The loop consumer is closed: free what it holds and the b2.
+static void onPollClosed (uv_handle_t* handle) {
+  struct B2 * b2 = handle->data;
+  napi_env env = b2->consumer.env;
+
+  free(handle);
+  if (b2->consumer.onRun) {
+    assert(napi_ok == napi_delete_reference(env, b2->consumer.onRun));
+    assert(napi_ok == napi_async_destroy(env, b2->consumer.context));
+  }
+  Finalize(env, b2);
+}
+
 // Constructor for instances of the `B2Type` class. This doesn't need to do
 // anything since all we want the class for is to be able to type-check
 // JavaScript objects that carry within them a pointer to a native `B2Type`
@@ -77,24 +216,96 @@ napi_value B2TypeConstructor (napi_env env, napi_callback_info info) {
   return NULL;
 }
 
+static void CallJs_onDrain (napi_env env, napi_value js_cb, void* context,
+    void* data) {
+  napi_value undefined;
+
+  if (env == NULL) return; // the b2 is closed
+  assert(napi_get_undefined(env, &undefined) == napi_ok);
+  assert(napi_ok == napi_call_function(env, undefined, js_cb, 0, 0, 0));
+}
+
 static napi_value B2T_Open (napi_env env, napi_callback_info info) {
   napi_value this;
   ModuleData* md;
   struct B2 * b2;
+  char error[256];
  
   assert(napi_ok == napi_get_cb_info(env, info, 0, 0, &this, (void*)&md));
   assert(napi_ok == napi_unwrap(env, this, (void*)&b2));
 
-  // Reset the shared buffer.
-  b2->produceCount = 0;
-  b2->consumeCount = 0;
+  // Bind (connect) the sockets here, so that the errors go to JavaScript.
+  if (b2->producer.openSockets &&
+      b2->producer.openSockets(b2, error, sizeof(error))) {
+    napi_throw_error(env, NULL, error);
+    return NULL;
+  }
+  if (b2->consumer.openSockets &&
+      b2->consumer.openSockets(b2, error, sizeof(error))) {
+    if (b2->producer.file) { // no initOnOpen took it, see takeFile
+      close(b2->producer.file);
+      b2->producer.file = 0;
+    }
+    else if (b2->producer.openSockets) b2->producer.cleanupOnClose(b2);
+    napi_throw_error(env, NULL, error);
+    return NULL;
+  }
+  // Reset the wake eventfds of a polling producer and consumer, and the
+  // shared buffer.
+  if (b2->producer.wakeFd) {
+    uint64_t value;
+
+    if (read(b2->producer.wakeFd, &value, sizeof(value)) == -1)
+      assert(errno == EAGAIN);
+  }
+  if (b2->consumer.wakeFd) {
+    uint64_t value;
+
+    if (read(b2->consumer.wakeFd, &value, sizeof(value)) == -1)
+      assert(errno == EAGAIN);
+  }
+  atomic_store(&b2->produceCount, 0);
+  atomic_store(&b2->consumeCount, 0);
+  b2->consumeCountCached = b2->produceCountCached = 0;
+  atomic_store(&b2->producerSleeping, false);
+  atomic_store(&b2->consumerSleeping, false);
   b2->isOpen = 1;
 
-  // Create and start the consumer thread.
+#ifdef __gnu_linux__
+  // Poll the eventfd of the loop consumer on the event loop, the sharedBuffer
+  // being empty; otherwise create and start the consumer thread.
+  if (b2->consumer.loop) {
+    uv_loop_t* loop;
+
+    assert(napi_ok == napi_get_uv_event_loop(env, &loop));
+    b2->consumer.notifyFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    assert(b2->consumer.notifyFd > 0);
+    b2->consumer.poll = malloc(sizeof(uv_poll_t));
+    assert(b2->consumer.poll);
+    b2->consumer.poll->data = b2;
+    b2->consumer.run = NULL;
+    b2->consumer.inFlight = b2->consumer.batchSize = 0;
+    atomic_store(&b2->consumerSleeping, true);
+    assert(0 == uv_poll_init(loop, b2->consumer.poll, b2->consumer.notifyFd));
+    assert(0 == uv_poll_start(b2->consumer.poll, UV_READABLE, onNotify));
+  }
+  else
+#endif
   assert(uv_thread_create(&b2->consumerThread, consumeTokens, b2) == 0);
 
-  // Create and start the producer thread.
+  // Create and start the producer thread, with the 'drain' function.
+  if (b2->producer.drainListener) {
+    napi_value listener, name;
+
+    assert(napi_ok == napi_get_reference_value(env,
+          b2->producer.drainListener, &listener));
+    assert(napi_ok == napi_create_string_utf8(env, "b2 drain",
+          NAPI_AUTO_LENGTH, &name));
+    assert(napi_ok == napi_create_threadsafe_function(env, listener, 0, name,
+          0, 1, 0, 0, 0, CallJs_onDrain, &b2->producer.onDrain));
+  }
   assert(uv_thread_create(&b2->producerThread, produceTokens, b2) == 0);
+  b2->started = true;
 
   return NULL;
 }
@@ -108,16 +319,43 @@ static napi_value B2T_Close (napi_env env, napi_callback_info info) {
   assert(napi_ok == napi_unwrap(env, this, (void*)&b2));
 
   if (b2->isOpen) {
+    uint64_t one = 1;
+
+    // Wake a producer or a consumer polling its fds first; the eventfds are
+    // the b2's until Finalize.
+    if (b2->producer.wakeFd)
+      assert(sizeof(one) == write(b2->producer.wakeFd, &one, sizeof(one)));
+    if (b2->consumer.wakeFd)
+      assert(sizeof(one) == write(b2->consumer.wakeFd, &one, sizeof(one)));
     b2->isOpen = 0;
     uv_mutex_lock(&b2->tokenProducingMutex);
     uv_cond_signal(&b2->tokenProducing);
     uv_mutex_unlock(&b2->tokenProducingMutex);
+
+    // Wake the threads sleeping on a full or an empty sharedBuffer.
+    uv_mutex_lock(&b2->tokenConsumedMutex);
+    uv_cond_signal(&b2->tokenConsumed);
+    uv_mutex_unlock(&b2->tokenConsumedMutex);
+    uv_mutex_lock(&b2->tokenProducedMutex);
+    uv_cond_signal(&b2->tokenProduced);
+    uv_mutex_unlock(&b2->tokenProducedMutex);
+    uv_mutex_lock(&b2->tokenConsumingMutex);
+    uv_cond_signal(&b2->tokenConsuming);
+    uv_mutex_unlock(&b2->tokenConsumingMutex);
+
+    // The loop consumer is finalized once its poll handle is closed; the
+    // 'readable' function learns from CT_Pull that the b2 is closed.
+    if (b2->consumer.loop) {
+      if (b2->consumer.pulls) drainOnLoop(b2);
+      assert(0 == uv_poll_stop(b2->consumer.poll));
+      uv_close((uv_handle_t*)b2->consumer.poll, onPollClosed);
+    }
   }
   else {
 #ifdef DEBUG_PRINTF
     printf("B2T_Close sid %u\n", b2->b2t_this.sid);
 #endif
-    Finalize(b2);
+    Finalize(env, b2);
   }
   
   return NULL;
@@ -153,7 +391,8 @@ napi_value ProducerTypeConstructor (napi_env env, napi_callback_info info) {
   return NULL;
 }
 
-static inline void initTokenType (TokenType* tt, char* theMessage) {
+static inline void
+initTokenType (TokenType* tt, const char* theMessage, size_t size) {
   struct timeval timer_us;
   if (gettimeofday(&timer_us, NULL) == 0) {
     tt->theDelay = ((long long int) timer_us.tv_sec) * 1000000ll +
@@ -162,38 +401,305 @@ static inline void initTokenType (TokenType* tt, char* theMessage) {
   else tt->theDelay = -1ll;
   
   size_t i0 = sizeof(tt->theMessage) - 1;
-  strncpy(tt->theMessage, theMessage, i0);
-  tt->theMessage[i0] = '\0';
+  if (size > i0) size = i0;
+  memcpy(tt->theMessage, theMessage, size);
+  tt->theMessage[size] = '\0';
+  tt->length = size; // theMessage may hold '\0's, see B3.Readable
 } 
 
+// Allocate a tokens2produce node for a record with size bytes of theMessage;
+// the caller fills theMessage in.
+static inline struct fifo* newRecordNode (size_t size) {
+  struct fifo* t = malloc(sizeof(struct fifo) + recordSpan(size));
+  RecordType* r = fifoRecord(t);
+
+  r->size = size;
+  r->theDelay = nowUs();
+  r->source = 0;
+  r->theMessage[size] = '\0';
+  return t;
+}
+
+// Allocate a tokens2produce node holding size bytes of theMessage, a TokenType
+// of the pool or a record depending on the mode of the b2. Returns NULL if
+// the pool is exhausted.
+static struct fifo*
+newTokenNode (struct B2 * b2, const char* theMessage, size_t size) {
+  if (b2->records) {
+    struct fifo* t = newRecordNode(size);
+    memcpy(fifoRecord(t)->theMessage, theMessage, size);
+    return t;
+  }
+  TokenType* tt = poolAlloc(&b2->producer.pool);
+  if (tt == NULL) return NULL;
+  memset(tt, 0, sizeof(*tt));
+  initTokenType(tt, theMessage, size);
+  return &tt->tt_this;
+}
+
+// Free the tokens2produce node t, see newTokenNode.
+static inline void freeTokenNode (struct B2 * b2, struct fifo* t) {
+  if (b2->records) free(t);
+  else poolFree(&b2->producer.pool, (TokenType*)t);
+}
+
+// Copy the token in node t straight to the sharedBuffer, if there is room
+// for it. The direct sender does this on the main thread and on the producer
+// thread, holding tokenProducingMutex.
+static bool directProduce (struct B2 * b2, struct fifo* t) {
+  if (b2->records) {
+    RecordType* r = tryReserveRecord(b2, fifoRecord(t)->size);
+    if (r == NULL) return false;
+    memcpy(r, fifoRecord(t), recordSpan(fifoRecord(t)->size));
+    r->sid = t->sid;
+    commitRecord(b2, r);
+  }
+  else {
+    TokenType* tt = reserveToken(b2);
+    if (tt == NULL) return false;
+    memcpy(tt, t, sizeof(TokenType));
+    commitToken(b2);
+  }
+  return true;
+}
+
+// Initialise the token with size bytes of theMessage straight in the
+// sharedBuffer, if there is room for it. The caller holds tokenProducingMutex.
+static bool directSend (struct B2 * b2, const char* theMessage, size_t size) {
+  struct mpsc* q = &b2->producer.tokens2produce;
+
+  if (b2->records) {
+    RecordType* r = tryReserveRecord(b2, size);
+    if (r == NULL) return false;
+    r->sid = mpscSid(q);
+    r->size = size;
+    r->theDelay = nowUs();
+    memcpy(r->theMessage, theMessage, size);
+    r->theMessage[size] = '\0';
+    commitRecord(b2, r);
+  }
+  else {
+    TokenType* tt = reserveToken(b2);
+    if (tt == NULL) return false;
+    initTokenType(tt, theMessage, size);
+    tt->tt_this.sid = mpscSid(q);
+    commitToken(b2);
+  }
+  return true;
+}
+
+// Queue the token in node t for the producer thread of the b2, from any
+// thread and without a lock; wake the producer thread only if it waits for
+// a token, see popToken. The fence pairs with the one in waitForPush.
+static void pushToken (struct B2 * b2, struct fifo* t) {
+  struct mpsc* q = &b2->producer.tokens2produce;
+
+  t->sid = mpscSid(q);
+  mpscPush(q, t);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&q->sleeping, memory_order_relaxed)) {
+    uv_mutex_lock(&b2->tokenProducingMutex);
+    uv_cond_signal(&b2->tokenProducing);
+    uv_mutex_unlock(&b2->tokenProducingMutex);
+  }
+}
+
+// Wait, holding tokenProducingMutex, until a token is queued or the b2 is
+// closed.
+static inline void waitForPush (struct B2 * b2) {
+  struct mpsc* q = &b2->producer.tokens2produce;
+
+  atomic_store_explicit(&q->sleeping, true, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  while (b2->isOpen && mpscEmpty(q))
+    uv_cond_wait(&b2->tokenProducing, &b2->tokenProducingMutex);
+  atomic_store_explicit(&q->sleeping, false, memory_order_relaxed);
+}
+
+// The value send() returns: false once highWaterMark tokens are queued. The
+// producer thread then emits 'drain' when it has brought them down to
+// lowWaterMark, see checkDrain; the seq_cst accesses of needDrain and of the
+// queue size pair, so that one of the threads sees the other.
+static napi_value belowHighWaterMark (napi_env env, struct B2 * b2) {
+  struct Producer* p = &b2->producer;
+  bool below = true;
+  napi_value result;
+
+  if (atomic_load(&p->tokens2produce.size) >= p->highWaterMark) {
+    atomic_store(&p->needDrain, true);
+    below = atomic_load(&p->tokens2produce.size) <= p->lowWaterMark &&
+      atomic_exchange(&p->needDrain, false); // drained already
+  }
+  assert(napi_ok == napi_get_boolean(env, below, &result));
+  return result;
+}
+
+// Emit 'drain' if a send() has returned false and the queue is down to
+// lowWaterMark; the producer thread checks this after a pop.
+static inline void checkDrain (struct B2 * b2) {
+  struct Producer* p = &b2->producer;
+
+  if (atomic_load(&p->needDrain) &&
+      atomic_load(&p->tokens2produce.size) <= p->lowWaterMark &&
+      atomic_exchange(&p->needDrain, false) && p->onDrain)
+    assert(napi_ok == napi_call_threadsafe_function(p->onDrain, NULL,
+          napi_tsfn_nonblocking));
+}
+
+// Pop the next queued token, waiting for one; NULL if the b2 is closed.
+static struct fifo* popToken (struct B2 * b2) {
+  struct mpsc* q = &b2->producer.tokens2produce;
+  struct fifo* t = NULL;
+
+  while (b2->isOpen && (t = mpscPop(q)) == NULL) {
+    if (!mpscEmpty(q)) { // a push is linking its node
+      cpuRelax();
+      continue;
+    }
+    uv_mutex_lock(&b2->tokenProducingMutex);
+    waitForPush(b2);
+    uv_mutex_unlock(&b2->tokenProducingMutex);
+  }
+  if (t) checkDrain(b2);
+  return t;
+}
+
+// Queue the token in node t and notify the producer thread. The direct sender
+// produces the token right away instead, unless the b2 is not open yet (open
+// resets the sharedBuffer), there are tokens queued ahead of it or the
+// sharedBuffer is full; it holds tokenProducingMutex, as its producer thread
+// writes to the sharedBuffer, too.
+static void sendToken (struct B2 * b2, struct fifo* t) {
+  struct mpsc* q = &b2->producer.tokens2produce;
+
+  if (!b2->producer.direct) {
+    pushToken(b2, t);
+    return;
+  }
+  uv_mutex_lock(&b2->tokenProducingMutex);
+  t->sid = mpscSid(q);
+  if (b2->isOpen && mpscEmpty(q) && directProduce(b2, t))
+    freeTokenNode(b2, t);
+  else {
+    mpscPush(q, t);
+    uv_cond_signal(&b2->tokenProducing);
+  }
+  uv_mutex_unlock(&b2->tokenProducingMutex);
+}
+
+// Like sendToken, but the direct sender copies the bytes to the sharedBuffer
+// without allocating a node. Returns false if the pool is exhausted.
+static bool sendBytes (struct B2 * b2, const char* theMessage, size_t size) {
+  struct mpsc* q = &b2->producer.tokens2produce;
+  struct fifo* t = NULL;
+  bool sent;
+
+  if (!b2->producer.direct) {
+    if ((t = newTokenNode(b2, theMessage, size))) pushToken(b2, t);
+    return t != NULL;
+  }
+  uv_mutex_lock(&b2->tokenProducingMutex);
+  if (!(sent = b2->isOpen && mpscEmpty(q) &&
+          directSend(b2, theMessage, size)) &&
+      (t = newTokenNode(b2, theMessage, size))) {
+    t->sid = mpscSid(q);
+    mpscPush(q, t);
+    uv_cond_signal(&b2->tokenProducing);
+  }
+  uv_mutex_unlock(&b2->tokenProducingMutex);
+  return sent || t != NULL;
+}
+
 static napi_value PT_Send (napi_env env, napi_callback_info info) {
-  size_t argc = 1;
+  size_t argc = 1, size;
   napi_value argv, this;
   ModuleData* md;
   struct B2 * b2;
   char msg[128];
-  TokenType* tt;
+  struct fifo* t;
 
   assert(napi_ok == napi_get_cb_info(env, info, &argc, &argv, &this, (void*)&md));
   assert(napi_ok == napi_unwrap(env, this, (void*)&b2));
-  assert(napi_ok == napi_get_value_string_utf8(env, argv, msg, 128, &argc));
 
   // Initialise the token with the item data, queue it and notify
-  // the producer thread.
-  tt = memset(malloc(sizeof(*tt)), 0, sizeof(*tt));
-  initTokenType(tt, msg);
-#ifdef DEBUG_PRINTF
-  printf("PT_Send sid %d is about to queue tt->theMessage '%s'\n",
-      b2->b2t_this.sid, tt->theMessage);
-#endif
-  uv_mutex_lock(&b2->tokenProducingMutex);
-  fifoIn(&b2->producer.tokens2produce, &tt->tt_this);
-  uv_cond_signal(&b2->tokenProducing);
-  uv_mutex_unlock(&b2->tokenProducingMutex);
+  // the producer thread. In the record mode, the whole message is queued.
+  if (b2->records) {
+    assert(napi_ok == napi_get_value_string_utf8(env, argv, 0, 0, &size));
+    if (size > recordSizeMax(b2)) {
+      napi_throw_range_error(env, 0, "message does not fit the sharedBuffer");
+      return NULL;
+    }
+    t = newRecordNode(size);
+    assert(napi_ok == napi_get_value_string_utf8(env, argv,
+          fifoRecord(t)->theMessage, size + 1, &size));
+  }
+  else {
+    assert(napi_ok == napi_get_value_string_utf8(env, argv, msg, 128, &size));
+    if ((t = newTokenNode(b2, msg, size)) == NULL) {
+      napi_throw_range_error(env, 0, "the token pool is exhausted");
+      return NULL;
+    }
+  }
 #ifdef DEBUG_PRINTF
-  printf("PT_Send sid %d queued token sid %d\n",
-      b2->b2t_this.sid, tt->tt_this.sid);
+  printf("PT_Send sid %d is about to queue a token\n", b2->b2t_this.sid);
 #endif
+  sendToken(b2, t);
+  return belowHighWaterMark(env, b2);
+}
+
+// Send the bytes of a Buffer or an ArrayBuffer. The direct sender copies them
+// once, straight to the sharedBuffer.
+static napi_value PT_SendBuffer (napi_env env, napi_callback_info info) {
+  size_t argc = 1, size;
+  napi_value argv, this;
+  ModuleData* md;
+  struct B2 * b2;
+  void* data;
+  bool isBuffer;
+
+  assert(napi_ok == napi_get_cb_info(env, info, &argc, &argv, &this, (void*)&md));
+  assert(napi_ok == napi_unwrap(env, this, (void*)&b2));
+  assert(napi_ok == napi_is_buffer(env, argv, &isBuffer));
+  if (isBuffer)
+    assert(napi_ok == napi_get_buffer_info(env, argv, &data, &size));
+  else if (napi_ok != napi_get_arraybuffer_info(env, argv, &data, &size)) {
+    napi_throw_type_error(env, 0, "expected a Buffer or an ArrayBuffer");
+    return NULL;
+  }
+  if (b2->records && size > recordSizeMax(b2)) {
+    napi_throw_range_error(env, 0, "message does not fit the sharedBuffer");
+    return NULL;
+  }
+  if (!sendBytes(b2, data, size)) {
+    napi_throw_range_error(env, 0, "the token pool is exhausted");
+    return NULL;
+  }
+  return belowHighWaterMark(env, b2);
+}
+
+// Subscribe to the 'drain' event, see belowHighWaterMark. Each B2T_Open
+// makes a threadsafe function of it, which the producer thread releases on
+// close.
+static napi_value PT_On (napi_env env, napi_callback_info info) {
+  size_t argc = 2;
+  napi_value argv[2], this;
+  ModuleData* md;
+  struct B2 * b2;
+  char event[7];
+
+  assert(napi_ok == napi_get_cb_info(env, info, &argc, argv, &this, (void*)&md));
+  assert(napi_ok == napi_unwrap(env, this, (void*)&b2));
+  assert(napi_ok == napi_get_value_string_utf8(env, argv[0], event, 7, &argc));
+  if (strcmp("drain", event)) {
+    napi_throw_type_error(env, NULL, "unknown producer event");
+    return NULL;
+  }
+  if (b2->producer.drainListener) {
+    napi_throw_error(env, NULL, "'drain' has a listener already");
+    return NULL;
+  }
+  assert(napi_ok == napi_create_reference(env, argv[1], 1,
+        &b2->producer.drainListener));
   return NULL;
 }
 
@@ -221,7 +727,21 @@ static napi_value GetSid (napi_env env, napi_callback_info info) {
 static void FinalizeOnToken (napi_env env, void* data, void* context) {
   struct B2 * b2 = (struct B2 *)data;
 
-  Finalize(b2);
+  Finalize(env, b2);
+}
+
+// The JavaScript object holding the native token. A sharedBuffer slot has its
+// TokenType object for the lifetime of the b2 (see newB2native), wrapping the
+// TokenSlot of the slot, so that the delivery of a token allocates nothing; a
+// record gets a new RecordType object.
+static inline napi_value wrapToken (napi_env env, struct B2 * b2, void* token) {
+  napi_value result;
+
+  if (b2->consumer.wrappers == NULL)
+    return newInstance(env, b2->md->rt_constructor, token, 0, 0);
+  assert(napi_ok == napi_get_reference_value(env,
+        b2->consumer.wrappers[(TokenType*)token - b2->sharedBuffer], &result));
+  return result;
 }
 
 // This function is responsible for converting the native data coming in from
@@ -229,70 +749,293 @@ static void FinalizeOnToken (napi_env env, void* data, void* context) {
 // function.
 void CallJs_onToken(napi_env env, napi_value js_cb, void* context, void* data) {
   struct B2 * b2 = (struct B2 *)context;
-  napi_value constructor;
   napi_value undefined, argv;
 
   // Retrieve the JavaScript `undefined` value. This will serve as the `this`
   // value for the function call.
   assert(napi_get_undefined(env, &undefined) == napi_ok);
-    
-  // Retrieve the constructor for the JavaScript class from which the item
-  // holding the native data will be constructed.
-  assert(napi_ok == napi_get_reference_value(
-        env, b2->md->tt_constructor, &constructor));
 
-  // Construct a new instance of the JavaScript class to hold the native item.
-  assert(napi_ok == napi_new_instance(env, constructor, 0, 0, &argv));
+  // Call the JavaScript function with the token wrapped into an instance of
+  // the JavaScript `TokenType` (`RecordType`) class.
+  argv = wrapToken(env, b2, data);
+  assert(napi_ok == napi_call_function(env, undefined, js_cb, 1, &argv, 0));
+}
 
-  // Associate the native token with the newly constructed JavaScript object.
-  assert(napi_ok == napi_wrap(env, argv, data, 0, 0, 0));
+// Like CallJs_onToken, but for the batch of b2->consumer.batchSize tokens
+// starting with the one in data. The JavaScript function gets an array of
+// tokens; the array itself is associated with the first token, so that
+// CT_DoneWith acknowledges the whole batch at once.
+void CallJs_onTokens(napi_env env, napi_value js_cb, void* context, void* data) {
+  struct B2 * b2 = (struct B2 *)context;
+  size_t i, n = b2->consumer.batchSize;
+  napi_value undefined, argv;
+  void* t = data;
 
-  // Call the JavaScript function with the token wrapped into an instance of
-  // the JavaScript `TokenType` class.
+  assert(napi_get_undefined(env, &undefined) == napi_ok);
+  assert(napi_ok == napi_create_array_with_length(env, n, &argv));
+  for (i = 0; i < n; i++) {
+    assert(napi_ok == napi_set_element(env, argv, i, wrapToken(env, b2, t)));
+    t = nextToken(b2, t);
+  }
+  assert(napi_ok == napi_wrap(env, argv, b2->consumer.slots ?
+        (void*)&b2->consumer.slots[(TokenType*)data - b2->sharedBuffer] : data,
+        0, 0, 0));
   assert(napi_ok == napi_call_function(env, undefined, js_cb, 1, &argv, 0));
 }
 
+// Like CallJs_onTokens, but the JavaScript function gets the byte offset of
+// the first token in the consumer.buffer and the number of tokens; it reads
+// them in place and calls consumer.release.
+void CallJs_onRun(napi_env env, napi_value js_cb, void* context, void* data) {
+  struct B2 * b2 = (struct B2 *)context;
+  napi_value undefined, argv[2];
+
+  assert(napi_get_undefined(env, &undefined) == napi_ok);
+  assert(napi_ok == napi_create_uint32(env,
+        (char*)data - (char*)b2->sharedBuffer, &argv[0]));
+  assert(napi_ok == napi_create_uint32(env, b2->consumer.batchSize, &argv[1]));
+  b2->consumer.running = true;
+  assert(napi_ok == napi_call_function(env, undefined, js_cb, 2, argv, 0));
+  b2->consumer.running = false;
+
+  // Wake the consumer thread once for all the releases of the function.
+  uv_mutex_lock(&b2->tokenConsumingMutex);
+  if (atomic_load_explicit(&b2->consumer.released, memory_order_relaxed))
+    uv_cond_signal(&b2->tokenConsuming);
+  uv_mutex_unlock(&b2->tokenConsumingMutex);
+}
+
+// Subscribe to the 'token' event (one token per call), the 'tokens' event
+// (an array of all the tokens available, see CallJs_onTokens) or the 'run'
+// event (all the tokens available, read in place, see CallJs_onRun). The
+// loop consumer delivers 'run' or 'readable' (see CT_Pull) only. The first
+// listener sets the delivery mode: there is one listener per consumer.
 static napi_value CT_On (napi_env env, napi_callback_info info) {
   size_t argc = 2;
-  napi_value argv[2], this, nameT; //, nameC;
+  napi_value argv[2], this, nameT, resource;
   ModuleData* md;
   struct B2 * b2;
-  char event[6], descT[] = "b2 token consumer";
+  struct Consumer* c;
+  char event[16], descT[] = "b2 token consumer";
+  bool token, tokens, run, readable;
 
   assert(napi_ok == napi_get_cb_info(env, info, &argc, argv, &this, (void*)&md));
   assert(napi_ok == napi_unwrap(env, this, (void*)&b2));
-  assert(napi_ok == napi_get_value_string_utf8(env, argv[0], event, 6, &argc));
-  if (strcmp("token", event) == 0) { // create the onToken tsfn
-    assert(napi_ok == napi_create_string_utf8(
-          env, descT, NAPI_AUTO_LENGTH, &nameT));
-    assert(napi_ok == napi_create_threadsafe_function(env, argv[1], 0, nameT,
-          0, 1, b2, FinalizeOnToken, b2, CallJs_onToken, &b2->consumer.onToken));
+  assert(napi_ok == napi_get_value_string_utf8(env, argv[0], event,
+        sizeof(event), &argc));
+  c = &b2->consumer;
+  token = strcmp("token", event) == 0;
+  tokens = strcmp("tokens", event) == 0;
+  run = strcmp("run", event) == 0;
+  readable = strcmp("readable", event) == 0;
+  if (!(token || tokens || run || readable)) {
+    napi_throw_error(env, NULL, "unknown consumer event");
+    return NULL;
+  }
+  if (c->onToken || c->onRun) { // the delivery mode is set
+    napi_throw_error(env, NULL, "the consumer has a listener already");
+    return NULL;
+  }
+  if (c->loop) { // called on the main thread, see drainOnLoop
+    if (!run && !readable) {
+      napi_throw_error(env, NULL,
+          "the loop consumer delivers 'run' or 'readable' only");
+      return NULL;
+    }
+    c->runs = run;
+    c->pulls = readable;
+    assert(napi_ok == napi_create_object(env, &resource));
+    assert(napi_ok == napi_async_init(env, resource, argv[0], &c->context));
+    assert(napi_ok == napi_create_reference(env, argv[1], 1, &c->onRun));
+    c->env = env;
+    return NULL;
+  }
+  if (readable) {
+    napi_throw_error(env, NULL, "'readable' needs the loop consumer");
+    return NULL;
   }
+  c->batches = tokens;
+  c->runs = run;
+  assert(napi_ok == napi_create_string_utf8(
+        env, descT, NAPI_AUTO_LENGTH, &nameT));
+  assert(napi_ok == napi_create_threadsafe_function(env, argv[1], 0, nameT,
+        0, 1, b2, FinalizeOnToken, b2,
+        tokens ? CallJs_onTokens : run ? CallJs_onRun : CallJs_onToken,
+        &c->onToken));
   return NULL;
 }
 
-static napi_value CT_DoneWith (napi_env env, napi_callback_info info) {
+// Release the first n tokens of the run passed to the 'run' JavaScript
+// function; the consumer thread then passes it the rest of them.
+static napi_value CT_Release (napi_env env, napi_callback_info info) {
   size_t argc = 1;
   napi_value this, argv;
   ModuleData* md;
-  TokenType* tt;
   struct B2 * b2;
+  struct Consumer* c;
+  size_t released;
+  uint32_t n;
 
   assert(napi_ok == napi_get_cb_info(env, info, &argc, &argv, &this, (void*)&md));
   assert(napi_ok == napi_unwrap(env, this, (void*)&b2));
+  c = &b2->consumer;
+  n = uint32(env, argv);
+  if (c->loop) {
+    if (n == 0 || n > c->batchSize) {
+      napi_throw_range_error(env, NULL, "release count out of the run");
+      return NULL;
+    }
+    releaseRun(b2, c->run, n);
+    c->inFlight -= n;
+    c->batchSize = 0;
+    c->run = NULL;
+    if (b2->isOpen && !c->pulls) drainOnLoop(b2);
+    return NULL;
+  }
+
+  // The releases of a run add up until the consumer thread takes them, see
+  // runRoundTrip; the acquire pairs with the release of the batchSize there.
+  uv_mutex_lock(&b2->tokenConsumingMutex);
+  released = atomic_load_explicit(&c->released, memory_order_relaxed);
+  if (n == 0 ||
+      n > atomic_load_explicit(&c->batchSize, memory_order_acquire) - released) {
+    uv_mutex_unlock(&b2->tokenConsumingMutex);
+    napi_throw_range_error(env, NULL, "release count out of the run");
+    return NULL;
+  }
+  atomic_fetch_add_explicit(&c->released, n, memory_order_release);
+  if (!c->running) uv_cond_signal(&b2->tokenConsuming); // see CallJs_onRun
+  uv_mutex_unlock(&b2->tokenConsumingMutex);
+  return NULL;
+}
+
+// Release the tokens of the previous pull, and return an array of all the
+// tokens available now in one call, read in place until the next pull (or
+// release); null when there is none yet, the 'readable' function being then
+// called once there is; undefined once the b2 is closed. The loop consumer
+// only, as it has no consumer thread.
+static napi_value CT_Pull (napi_env env, napi_callback_info info) {
+  napi_value this, result;
+  ModuleData* md;
+  struct B2 * b2;
+  struct Consumer* c;
+  long long int now;
+  size_t i, n;
+  void* t;
+
+  assert(napi_ok == napi_get_cb_info(env, info, 0, 0, &this, (void*)&md));
+  assert(napi_ok == napi_unwrap(env, this, (void*)&b2));
+  c = &b2->consumer;
+  if (!c->loop) {
+    napi_throw_error(env, NULL, "pull needs the loop consumer");
+    return NULL;
+  }
+  if (!b2->isOpen) return NULL;
+  if (c->run) releaseRun(b2, c->run, c->batchSize);
+  c->inFlight = c->batchSize = 0;
+  while ((c->run = peekRun(b2, &n)) == NULL)
+    if (awaitProduced(b2)) { // notifyFd will tell
+      assert(napi_ok == napi_get_null(env, &result));
+      return result;
+    }
+
+  now = nowUs();
+  assert(napi_ok == napi_create_array_with_length(env, n, &result));
+  for (i = 0, t = c->run; i < n; i++, t = nextToken(b2, t)) {
+    *delayOf(b2, t) = now - *delayOf(b2, t);
+    assert(napi_ok == napi_set_element(env, result, i, wrapToken(env, b2, t)));
+  }
+  c->inFlight = c->batchSize = n;
+  return result;
+}
+
+// The consumer.buffer property: the sharedBuffer as an external ArrayBuffer,
+// TokenType slots or RecordType records (see the layout binding).
+static napi_value CT_GetBuffer (napi_env env, napi_callback_info info) {
+  napi_value this;
+  ModuleData* md;
+  struct B2 * b2;
+
+  assert(napi_ok == napi_get_cb_info(env, info, 0, 0, &this, (void*)&md));
+  assert(napi_ok == napi_unwrap(env, this, (void*)&b2));
+  return b2ArrayBuffer(env, b2->sharedBuffer, b2->records ?
+      b2->sharedBuffer_size : sizeof(TokenType) * b2->sharedBuffer_size,
+      &b2->consumer.buffer);
+}
+
+// The consumer.indices property: a Uint32Array of one element over the
+// produceCount and one over the consumeCount, each on its own cache line
+// (see the layout binding).
+static napi_value CT_GetIndices (napi_env env, napi_callback_info info) {
+  napi_value this, property, arraybuffer, counter;
+  ModuleData* md;
+  struct B2 * b2;
+  atomic_uint* counts[2];
+  int i;
+
+  assert(napi_ok == napi_get_cb_info(env, info, 0, 0, &this, (void*)&md));
+  assert(napi_ok == napi_unwrap(env, this, (void*)&b2));
+  if (b2->consumer.indices)
+    assert(napi_ok == napi_get_reference_value(env, b2->consumer.indices,
+          &property));
+  else {
+    counts[0] = &b2->produceCount;
+    counts[1] = &b2->consumeCount;
+    assert(napi_ok == napi_create_array_with_length(env, 2, &property));
+    for (i = 0; i < 2; i++) {
+      arraybuffer = b2ArrayBuffer(env, counts[i], sizeof(atomic_uint),
+          &b2->consumer.counts[i]);
+      assert(napi_ok == napi_create_typedarray(env, napi_uint32_array, 1,
+            arraybuffer, 0, &counter));
+      assert(napi_ok == napi_set_element(env, property, i, counter));
+    }
+    assert(napi_ok == napi_create_reference(env, property, 1,
+          &b2->consumer.indices));
+  }
+  return property;
+}
+
+static napi_value CT_DoneWith (napi_env env, napi_callback_info info) {
+  size_t argc = 1;
+  napi_value this, argv;
+  ModuleData* md;
+  void* token;
+  struct B2 * b2;
 
-  // Retrieve the native token.
-  assert(napi_ok == napi_unwrap(env, argv, (void**)&tt));
+  assert(napi_ok == napi_get_cb_info(env, info, &argc, &argv, &this, (void*)&md));
+  assert(napi_ok == napi_unwrap(env, this, (void*)&b2));
 
-  // Notify the consumer thread that the token has been consumed.
+  // Retrieve the native token, see wrapToken.
+  assert(napi_ok == napi_unwrap(env, argv, &token));
+  if (!b2->records) token = ((struct TokenSlot*)token)->token;
+
+  // Notify the consumer thread that the token has been consumed. With a
+  // window of tokens in flight, it waits for tokenProduced, see windowRoundTrip.
+  if (b2->consumer.window > 1) {
+    uv_mutex_lock(&b2->tokenProducedMutex);
+    *delayOf(b2, token) = 0ll;
+    uv_cond_signal(&b2->tokenProduced);
+    uv_mutex_unlock(&b2->tokenProducedMutex);
+    return NULL;
+  }
   uv_mutex_lock(&b2->tokenConsumingMutex);
-  tt->theDelay = 0ll;
+  *delayOf(b2, token) = 0ll;
   uv_cond_signal(&b2->tokenConsuming);
   uv_mutex_unlock(&b2->tokenConsumingMutex);
   
   return NULL;
 }
 
+// The slot of the TokenType object jsthis; NULL, with the error thrown, once
+// the b2 of the token is finalized, as Finalize removes the wraps.
+static inline struct TokenSlot* unwrapSlot (napi_env env, napi_value jsthis) {
+  struct TokenSlot* slot;
+
+  if (napi_ok == napi_unwrap(env, jsthis, (void**)&slot)) return slot;
+  napi_throw_error(env, NULL, "the b2 of the token is closed");
+  return NULL;
+}
+
 // Constructor for instances of the `TokenType` class. This doesn't need to do
 // anything since all we want the class for is to be able to type-check
 // JavaScript objects that carry within them a pointer to a native `TokenType`
@@ -307,9 +1050,10 @@ static napi_value TT_GetSid (napi_env env, napi_callback_info info) {
   ModuleData* md;
   assert(napi_ok == napi_get_cb_info(env, info, 0, 0, &jsthis, (void*)&md));
   assert(is_instanceof(env, md->tt_constructor, jsthis));
-  struct fifo *tt_this;
-  assert(napi_ok == napi_unwrap(env, jsthis, (void**)&tt_this));
-  assert(napi_ok == napi_create_uint32(env, tt_this->sid, &property));
+  struct TokenSlot* slot;
+  if ((slot = unwrapSlot(env, jsthis)) == NULL) return NULL;
+  assert(napi_ok == napi_create_uint32(env, slot->token->tt_this.sid,
+        &property));
   return property;
 }
 
@@ -319,10 +1063,11 @@ static napi_value TT_GetMessage (napi_env env, napi_callback_info info) {
   ModuleData* md;
   assert(napi_ok == napi_get_cb_info(env, info, 0, 0, &jsthis, (void*)&md));
   assert(is_instanceof(env, md->tt_constructor, jsthis));
-  TokenType* token;
-  assert(napi_ok == napi_unwrap(env, jsthis, (void**)&token));
-  assert(napi_ok == napi_create_string_utf8(
-        env, token->theMessage, NAPI_AUTO_LENGTH, &property));
+  struct TokenSlot* slot;
+  if ((slot = unwrapSlot(env, jsthis)) == NULL) return NULL;
+  size_t size;
+  const char* m = tokenMessage(slot->b2, slot->token, &size);
+  assert(napi_ok == napi_create_string_utf8(env, m, size, &property));
   return property;
 }
 
@@ -332,9 +1077,76 @@ static napi_value TT_GetDelay (napi_env env, napi_callback_info info) {
   ModuleData* md;
   assert(napi_ok == napi_get_cb_info(env, info, 0, 0, &jsthis, (void*)&md));
   assert(is_instanceof(env, md->tt_constructor, jsthis));
-  TokenType* token;
-  assert(napi_ok == napi_unwrap(env, jsthis, (void**)&token));
-  assert(napi_ok == napi_create_int64(env, token->theDelay, &property));
+  struct TokenSlot* slot;
+  if ((slot = unwrapSlot(env, jsthis)) == NULL) return NULL;
+  assert(napi_ok == napi_create_int64(env, slot->token->theDelay, &property));
+  return property;
+}
+
+// Getter for the `source` property of the `TokenType` object.
+static napi_value TT_GetSource (napi_env env, napi_callback_info info) {
+  napi_value jsthis, property;
+  ModuleData* md;
+  assert(napi_ok == napi_get_cb_info(env, info, 0, 0, &jsthis, (void*)&md));
+  assert(is_instanceof(env, md->tt_constructor, jsthis));
+  struct TokenSlot* slot;
+  if ((slot = unwrapSlot(env, jsthis)) == NULL) return NULL;
+  assert(napi_ok == napi_create_int32(env, slot->token->source, &property));
+  return property;
+}
+
+// Constructor for instances of the `RecordType` class, the `TokenType` of a b2
+// in the record mode.
+napi_value RecordTypeConstructor (napi_env env, napi_callback_info info) {
+  return NULL;
+}
+
+// Getter for the `sid` property of the `RecordType` object.
+static napi_value RT_GetSid (napi_env env, napi_callback_info info) {
+  napi_value jsthis, property;
+  ModuleData* md;
+  assert(napi_ok == napi_get_cb_info(env, info, 0, 0, &jsthis, (void*)&md));
+  assert(is_instanceof(env, md->rt_constructor, jsthis));
+  RecordType* record;
+  assert(napi_ok == napi_unwrap(env, jsthis, (void**)&record));
+  assert(napi_ok == napi_create_uint32(env, record->sid, &property));
+  return property;
+}
+
+// Getter for the `message` property of the `RecordType` object.
+static napi_value RT_GetMessage (napi_env env, napi_callback_info info) {
+  napi_value jsthis, property;
+  ModuleData* md;
+  assert(napi_ok == napi_get_cb_info(env, info, 0, 0, &jsthis, (void*)&md));
+  assert(is_instanceof(env, md->rt_constructor, jsthis));
+  RecordType* record;
+  assert(napi_ok == napi_unwrap(env, jsthis, (void**)&record));
+  assert(napi_ok == napi_create_string_utf8(
+        env, record->theMessage, record->size, &property));
+  return property;
+}
+
+// Getter for the `delay` property of the `RecordType` object.
+static napi_value RT_GetDelay (napi_env env, napi_callback_info info) {
+  napi_value jsthis, property;
+  ModuleData* md;
+  assert(napi_ok == napi_get_cb_info(env, info, 0, 0, &jsthis, (void*)&md));
+  assert(is_instanceof(env, md->rt_constructor, jsthis));
+  RecordType* record;
+  assert(napi_ok == napi_unwrap(env, jsthis, (void**)&record));
+  assert(napi_ok == napi_create_int64(env, record->theDelay, &property));
+  return property;
+}
+
+// Getter for the `source` property of the `RecordType` object.
+static napi_value RT_GetSource (napi_env env, napi_callback_info info) {
+  napi_value jsthis, property;
+  ModuleData* md;
+  assert(napi_ok == napi_get_cb_info(env, info, 0, 0, &jsthis, (void*)&md));
+  assert(is_instanceof(env, md->rt_constructor, jsthis));
+  RecordType* record;
+  assert(napi_ok == napi_unwrap(env, jsthis, (void**)&record));
+  assert(napi_ok == napi_create_int32(env, record->source, &property));
   return property;
 }
 
@@ -343,12 +1155,23 @@ static inline void InitModuleData (napi_env env, ModuleData* md) {
  
   // Define the token type. The md->tt_constructor napi_ref will be deleted
   // during the 'FreeModuleData' call.
-  char* propNamesTT[3] = { "sid", "message", "delay" };
-  napi_property_descriptor pTT[3];
-  napi_callback methodsTT[3] = { 0, 0, 0 },
-               gettersTT[3] = { TT_GetSid, TT_GetMessage, TT_GetDelay }; 
+  char* propNamesTT[4] = { "sid", "message", "delay", "source" };
+  napi_property_descriptor pTT[4];
+  napi_callback methodsTT[4] = { 0, 0, 0, 0 },
+               gettersTT[4] = {
+                 TT_GetSid, TT_GetMessage, TT_GetDelay, TT_GetSource }; 
   defObj_n_props(env, md, "TokenType", TokenTypeConstructor,
-      &md->tt_constructor, 3, pTT, propNamesTT, gettersTT, methodsTT);
+      &md->tt_constructor, 4, pTT, propNamesTT, gettersTT, methodsTT);
+
+  // Define the record type. The md->rt_constructor napi_ref will be deleted
+  // during the 'FreeModuleData' call.
+  char* propNamesRT[4] = { "sid", "message", "delay", "source" };
+  napi_property_descriptor pRT[4];
+  napi_callback methodsRT[4] = { 0, 0, 0, 0 },
+               gettersRT[4] = {
+                 RT_GetSid, RT_GetMessage, RT_GetDelay, RT_GetSource }; 
+  defObj_n_props(env, md, "RecordType", RecordTypeConstructor,
+      &md->rt_constructor, 4, pRT, propNamesRT, gettersRT, methodsRT);
 
   // Define the bounded buffer type. The md->b2t_constructor napi_ref 
   // will be deleted during the 'FreeModuleData' call.
@@ -361,21 +1184,24 @@ static inline void InitModuleData (napi_env env, ModuleData* md) {
 
   // Define the producer type. The md->pt_constructor napi_ref will be deleted
   // during the 'FreeModuleData' call.
-  char* propNamesPT[2] = { "sid", "send" };
-  napi_property_descriptor pPT[2];
-  napi_callback methodsPT[2] = { 0, PT_Send },
-                gettersPT[2] = { GetSid, 0 };
+  char* propNamesPT[4] = { "sid", "send", "sendBuffer", "on" };
+  napi_property_descriptor pPT[4];
+  napi_callback methodsPT[4] = { 0, PT_Send, PT_SendBuffer, PT_On },
+                gettersPT[4] = { GetSid, 0, 0, 0 };
   defObj_n_props(env, md, "ProducerType", ProducerTypeConstructor,
-      &md->pt_constructor, 2, pPT, propNamesPT, gettersPT, methodsPT);
+      &md->pt_constructor, 4, pPT, propNamesPT, gettersPT, methodsPT);
 
   // Define the consumer type. The md->ct_constructor napi_ref will be deleted
   // during the 'FreeModuleData' call.
-  char* propNamesCT[3] = { "sid", "on", "doneWith" };
-  napi_property_descriptor pCT[3];
-  napi_callback methodsCT[3] = { 0, CT_On, CT_DoneWith },
-                gettersCT[3] = { GetSid, 0, 0 };
+  char* propNamesCT[7] = {
+    "sid", "on", "doneWith", "release", "pull", "buffer", "indices" };
+  napi_property_descriptor pCT[7];
+  napi_callback methodsCT[7] = {
+    0, CT_On, CT_DoneWith, CT_Release, CT_Pull, 0, 0 },
+                gettersCT[7] = {
+    GetSid, 0, 0, 0, 0, CT_GetBuffer, CT_GetIndices };
   defObj_n_props(env, md, "ConsumerType", ConsumerTypeConstructor,
-      &md->ct_constructor, 3, pCT, propNamesCT, gettersCT, methodsCT);
+      &md->ct_constructor, 7, pCT, propNamesCT, gettersCT, methodsCT);
 }
 
 static void producer_cleanupOnClose_default (struct B2 *b2) {
@@ -387,41 +1213,17 @@ static void producer_cleanupOnClose_default (struct B2 *b2) {
 static void producer_produceToken_default (TokenType* tt, struct B2 * b2) {
   struct fifo* t;
 #ifdef DEBUG_PRINTF
-  if (b2->isOpen && b2->producer.tokens2produce.size == 0)
+  if (b2->isOpen && mpscEmpty(&b2->producer.tokens2produce))
     printf("produceToken sid %d, wait for a token from the main thread\n",
         b2->b2t_this.sid);
 #endif
-  uv_mutex_lock(&b2->tokenProducingMutex);
-
-  if (b2->producer.tokens2produce.size > 0) { // the queue has tokens to produce
 
-    // Token(s) have been produced by another thread,
-    // remove the first token from the queue.
-    t = fifoOut(&b2->producer.tokens2produce);
-    if (t) { // if it's not NULL, copy it to the shared buffer and return
-      memcpy(tt, t, sizeof(TokenType));
-      free(t);
-      uv_mutex_unlock(&b2->tokenProducingMutex);
+  // Copy the token queued by another thread to the shared buffer, and free it.
+  if ((t = popToken(b2)) == NULL) return; // closed
+  memcpy(tt, t, sizeof(TokenType));
+  poolFree(&b2->producer.pool, (TokenType*)t);
 #ifdef DEBUG_PRINTF
-      printf("produceToken sid %d, token sid %d shared, returning 1\n", 
-          b2->b2t_this.sid, tt->tt_this.sid);
-#endif
-      return;
-    }
-  }
-
-  // Otherwise, wait for a token from another thread.
-  while (b2->isOpen && b2->producer.tokens2produce.size == 0)
-    uv_cond_wait(&b2->tokenProducing, &b2->tokenProducingMutex);
-
-  if (b2->isOpen) {
-    t = fifoOut(&b2->producer.tokens2produce); // remove it from the queue,
-    memcpy(tt, t, sizeof(TokenType)); // copy to the shared buffer and free it
-    free(t);
-  }
-  uv_mutex_unlock(&b2->tokenProducingMutex);
-#ifdef DEBUG_PRINTF
-  printf("produceToken sid %d, token sid %d shared, returning 2\n", 
+  printf("produceToken sid %d, token sid %d shared\n",
       b2->b2t_this.sid, tt->tt_this.sid);
 #endif
 }
@@ -434,64 +1236,249 @@ static void consumer_cleanupOnClose_default (struct B2 * b2) {
 #endif
 }
 
-static void consumer_consumeToken_default (TokenType* tt, struct B2 * b2) {
-
-  // Set the consumer - producer delay in the tt->theDelay field.
-  long long int p = tt->theDelay;
+// Set the consumer - producer delay in the theDelay field of the consumed
+// token (a TokenType or a RecordType) and pass the token to the 'onToken'
+// JavaScript function. The main thread is done with the token when
+// CT_DoneWith sets its theDelay to zero.
+static void
+deliverToken (void* token, long long int* theDelay, struct B2 * b2) {
+  long long int p = *theDelay;
   struct timeval timer_us;
   if (gettimeofday(&timer_us, NULL) == 0) {
-    tt->theDelay = ((long long int) timer_us.tv_sec) * 1000000ll +
+    *theDelay = ((long long int) timer_us.tv_sec) * 1000000ll +
       (long long int) timer_us.tv_usec - p;
+    if (*theDelay == 0ll) *theDelay = 1ll; // not done with yet
   }
-  else tt->theDelay = -1ll;
-
-  // Pass the consumed token to the 'onToken' JavaScript function,
-  // then wait until the main thread is done with the token.
+  else *theDelay = -1ll;
   assert(napi_ok == napi_call_threadsafe_function(b2->consumer.onToken,
-        tt, napi_tsfn_blocking));
-  if (tt->theDelay != 0ll) {
+        token, napi_tsfn_blocking));
+}
+
+// Deliver the consumed token, then wait until the main thread is done with it.
+static void
+onTokenRoundTrip (void* token, long long int* theDelay, struct B2 * b2) {
+  deliverToken(token, theDelay, b2);
+  if (*theDelay != 0ll) {
 #ifdef DEBUG_PRINTF
-    printf("consumeToken sid %d, wait for the shared token sid %d to be consumed\n",
-        b2->b2t_this.sid, tt->tt_this.sid);
+    printf("consumeToken sid %d, wait for the shared token to be consumed\n",
+        b2->b2t_this.sid);
 #endif
     uv_mutex_lock(&b2->tokenConsumingMutex);
 
     // Wait for the token to be consumed
-    while (tt->theDelay != 0ll)
+    while (*theDelay != 0ll)
       uv_cond_wait(&b2->tokenConsuming, &b2->tokenConsumingMutex);
     uv_mutex_unlock(&b2->tokenConsumingMutex);
   }
 #ifdef DEBUG_PRINTF
-  printf("consumeToken sid %d, shared token sid %d consumed\n", 
-      b2->b2t_this.sid, tt->tt_this.sid);
+  printf("consumeToken sid %d, shared token consumed\n", b2->b2t_this.sid);
 #endif
 }
 
+static void consumer_consumeToken_default (TokenType* tt, struct B2 * b2) {
+  onTokenRoundTrip(tt, &tt->theDelay, b2);
+}
+
+static void consumer_consumeRecord_default (RecordType* r, struct B2 * b2) {
+  onTokenRoundTrip(r, &r->theDelay, b2);
+}
+
+// Pass the run of n tokens starting with first to the 'run' JavaScript
+// function, which reads them in place, then wait until it releases some of
+// them. Set the consumer - producer delay of each token first.
+static size_t runRoundTrip (void* first, size_t n, struct B2 * b2) {
+  long long int now = nowUs();
+  void* t = first;
+  size_t i;
+
+  for (i = 0; i < n; i++, t = nextToken(b2, t))
+    *delayOf(b2, t) = now - *delayOf(b2, t);
+  atomic_store_explicit(&b2->consumer.released, 0, memory_order_relaxed);
+  atomic_store_explicit(&b2->consumer.batchSize, n, memory_order_release);
+  assert(napi_ok == napi_call_threadsafe_function(b2->consumer.onToken,
+        first, napi_tsfn_blocking));
+  uv_mutex_lock(&b2->tokenConsumingMutex);
+  while (b2->isOpen && (n = atomic_load_explicit(&b2->consumer.released,
+          memory_order_acquire)) == 0)
+    uv_cond_wait(&b2->tokenConsuming, &b2->tokenConsumingMutex);
+  uv_mutex_unlock(&b2->tokenConsumingMutex);
+  return n;
+}
+
+static size_t
+consumer_consumeTokens_run (TokenType* slots, size_t n, struct B2 * b2) {
+  return runRoundTrip(slots, n, b2);
+}
+
+static size_t
+consumer_consumeRecords_run (RecordType* r, size_t n, struct B2 * b2) {
+  return runRoundTrip(r, n, b2);
+}
+
+// Pass the whole run of slots to the 'tokens' JavaScript function in one
+// round trip.
+static size_t
+consumer_consumeTokens_default (TokenType* slots, size_t n, struct B2 * b2) {
+  long long int now = nowUs();
+  size_t i;
+
+  for (i = 1; i < n; i++) slots[i].theDelay = now - slots[i].theDelay;
+  b2->consumer.batchSize = n;
+  onTokenRoundTrip(slots, &slots->theDelay, b2);
+  return n;
+}
+
+static size_t
+consumer_consumeRecords_default (RecordType* r, size_t n, struct B2 * b2) {
+  long long int now = nowUs();
+  RecordType* t = r;
+  size_t i;
+
+  for (i = 1; i < n; i++) {
+    t = nextRecord(t);
+    t->theDelay = now - t->theDelay;
+  }
+  b2->consumer.batchSize = n;
+  onTokenRoundTrip(r, &r->theDelay, b2);
+  return n;
+}
+
+// Keep up to window tokens of the run of n starting with first delivered to
+// the 'token' JavaScript function, not waiting for the main thread to be done
+// with each one of them. Return the number of tokens at the start of the run
+// the main thread is done with: CT_DoneWith may come in any order, the tokens
+// are released in order. Return 0 to be called again with a longer run.
+static size_t windowRoundTrip (void* first, size_t n, struct B2 * b2) {
+  struct Consumer* c = &b2->consumer;
+  size_t i, k = c->window < n ? c->window : n;
+  void* t = first;
+
+  for (i = 0; i < c->inFlight; i++) t = nextToken(b2, t);
+  for (; c->inFlight < k; c->inFlight++, t = nextToken(b2, t))
+    deliverToken(t, delayOf(b2, t), b2);
+
+  // Wait until the main thread is done with the first token, or until there
+  // are more tokens to deliver. CT_DoneWith signals tokenProduced, too.
+  uv_mutex_lock(&b2->tokenProducedMutex);
+  atomic_store_explicit(&b2->consumerSleeping, true, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  while (b2->isOpen && *delayOf(b2, first) != 0ll &&
+      (c->inFlight == c->window || b2->produceCountCached ==
+       atomic_load_explicit(&b2->produceCount, memory_order_relaxed)))
+    uv_cond_wait(&b2->tokenProduced, &b2->tokenProducedMutex);
+  atomic_store_explicit(&b2->consumerSleeping, false, memory_order_relaxed);
+  uv_mutex_unlock(&b2->tokenProducedMutex);
+  b2->produceCountCached =
+    atomic_load_explicit(&b2->produceCount, memory_order_acquire);
+
+  for (i = 0, t = first; i < c->inFlight && *delayOf(b2, t) == 0ll; i++)
+    t = nextToken(b2, t);
+  c->inFlight -= i;
+  return i;
+}
+
+static size_t
+consumer_consumeTokens_window (TokenType* slots, size_t n, struct B2 * b2) {
+  return windowRoundTrip(slots, n, b2);
+}
+
+static size_t
+consumer_consumeRecords_window (RecordType* r, size_t n, struct B2 * b2) {
+  return windowRoundTrip(r, n, b2);
+}
+
+// Wait until the b2 is closed; the producers that are out of tokens do this.
+static inline void waitForClose (struct B2 * b2) {
+  uv_mutex_lock(&b2->tokenProducingMutex);
+  while (b2->isOpen) uv_cond_wait(&b2->tokenProducing, &b2->tokenProducingMutex);
+  uv_mutex_unlock(&b2->tokenProducingMutex);
+}
+
+static void producer_produceRecord_default (struct B2 * b2) {
+  struct fifo* t = popToken(b2);
+  RecordType* r;
+
+  if (t == NULL) return;
+
+  // Copy the queued record to the shared buffer and free it.
+  if ((r = reserveRecord(b2, fifoRecord(t)->size))) {
+    memcpy(r, fifoRecord(t), recordSpan(fifoRecord(t)->size));
+    r->sid = t->sid;
+    commitRecord(b2, r);
+  }
+  free(t);
+}
+
 static void producer_cleanupOnClose_sidSetter (struct B2 * b2) {
 #ifdef DEBUG_PRINTF
   printf("producer_cleanupOnClose_sidSetter\n");
 #endif
 }
 
-static void consumer_cleanupOnClose_bioFileWriter (struct B2 * b2) {
-  TokenType * initToken = (TokenType*)fifoOut(&b2->producer.tokens2produce),
-     * tt = memset(malloc(sizeof(*tt)), 0, sizeof(*tt));
-  int * fd = (int *) initToken->theMessage;
+// The bioFileWriter stages its output and writes it when flushThreshold
+// bytes are buffered, on close, and for a message that alone is not smaller
+// than flushThreshold; 0 writes each message through.
+struct BioSink {
+  size_t size; // of the staged bytes
+  char buffer[];
+};
+
+static void writeAll (int fd, const char* m, size_t size) {
+  ssize_t written;
+
+  while (size) {
+    if ((written = write(fd, m, size)) == -1 && errno == EINTR) continue;
+    assert(written > 0);
+    m += written;
+    size -= written;
+  }
+}
+
+static void flushBio (struct B2 * b2, int fd) {
+  struct BioSink* s = (struct BioSink *)b2->consumer.sink;
+
+  writeAll(fd, s->buffer, s->size);
+  s->size = 0;
+}
+
+static void bufferBio (struct B2 * b2, int fd, const char* m, size_t size) {
+  struct BioSink* s = (struct BioSink *)b2->consumer.sink;
+  size_t threshold = b2->consumer.flushThreshold;
+
+  if (s->size + size > threshold) flushBio(b2, fd);
+  if (size >= threshold) {
+    writeAll(fd, m, size);
+    return;
+  }
+  memcpy(s->buffer + s->size, m, size);
+  s->size += size;
+}
+
+// Free the initToken and send the "Wrote ..." message to the r2l b2; the
+// file writers do this on close.
+static void reportWritten (struct B2 * b2) {
+  TokenType * initToken = (TokenType*)mpscPop(&b2->producer.tokens2produce);
   long long int now, started = initToken->theDelay;
   ModuleData* md = b2->md;
   struct B2 * b2r2l = (struct B2 *) md->b2instances.in;
   char msg[128];
+  struct fifo* t;
 
-  assert(0 == close(*fd));
-  free(initToken);
-
+  freeTokenNode(b2, &initToken->tt_this);
   now = nowUs();
   sprintf(msg, "Wrote %d messages in %lldµs\n", FILESIZE, now - started);
-  initTokenType(tt, msg);
-  uv_mutex_lock(&b2r2l->tokenProducingMutex);
-  fifoIn(&b2r2l->producer.tokens2produce, &tt->tt_this);
-  uv_cond_signal(&b2r2l->tokenProducing);
-  uv_mutex_unlock(&b2r2l->tokenProducingMutex);
+  if ((t = newTokenNode(b2r2l, msg, strlen(msg)))) pushToken(b2r2l, t);
+}
+
+static void consumer_cleanupOnClose_bioFileWriter (struct B2 * b2) {
+  TokenType * initToken = (TokenType*)b2->producer.tokens2produce.in;
+  int * fd = (int *) initToken->theMessage;
+
+  flushBio(b2, *fd);
+  free(b2->consumer.sink);
+  b2->consumer.sink = NULL;
+  assert(0 == close(*fd));
+  reportWritten(b2);
 #ifdef DEBUG_PRINTF
   printf("consumer_cleanupOnClose_bioFileWriter\n");
 #endif
@@ -501,13 +1488,17 @@ static void producer_initOnOpen_default (struct B2 * b2) {
 }
 
 static inline void configure_b2 (struct B2 * b2) {
-  TokenType* initToken =
-    (TokenType*)memset(malloc(sizeof(TokenType)), 0, sizeof(TokenType));
+  // Allocated like the token nodes, see freeTokenNode.
+  TokenType* initToken = b2->records ? malloc(sizeof(TokenType)) :
+    poolAlloc(&b2->producer.pool);
+
+  assert(initToken);
+  memset(initToken, 0, sizeof(TokenType));
 
   // Add initToken to the b2->producer.tokens2produce queue (the queue has
   // been initialized by NewB2). The initToken will be freed by 
   // consumer_cleanupOnClose_bioFileWriter.
-  fifoIn(&b2->producer.tokens2produce, &initToken->tt_this);
+  mpscPush(&b2->producer.tokens2produce, &initToken->tt_this);
 
   // Set initToken->tt_this.sid to the value of the FILESIZE macro - when 
   // the sid reaches zero, all the tokens will be produced and the b2 will be 
@@ -535,6 +1526,31 @@ static inline void initOnOpen (struct B2 * b2) {
   uv_mutex_unlock(&b2->tokenProducingMutex);
 }
 
+// Open the file of b2->data on the main thread, so that open() throws when
+// the file cannot be read; the initOnOpen of the file reader takes the fd.
+static int producer_openSockets_file (struct B2 * b2, char* error,
+    size_t errorSize) {
+  char path[sizeof(b2->data)];
+  size_t length = strcspn(b2->data, "\n"); // see configure_b2
+  int fd;
+
+  memcpy(path, b2->data, length);
+  path[length] = '\0';
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+    snprintf(error, errorSize, "open %s: %s", path, strerror(errno));
+    return -1;
+  }
+  b2->producer.file = fd;
+  return 0;
+}
+
+static inline int takeFile (struct B2 * b2) {
+  int fd = b2->producer.file;
+
+  b2->producer.file = 0;
+  return fd;
+}
+
 static void producer_initOnOpen_bioFileReader (struct B2 * b2) {
   initOnOpen(b2);
   TokenType* initToken = (TokenType*)b2->producer.tokens2produce.in;
@@ -544,7 +1560,7 @@ static void producer_initOnOpen_bioFileReader (struct B2 * b2) {
     (initToken->theMessage + sizeof(int) + sizeof(FILE *));
 #endif
 
-  *fpp = fopen(b2->data, "r");
+  assert((*fpp = fdopen(takeFile(b2), "r")));
 #ifdef DEBUG_PRINTF
   printf("producer_initOnOpen_bioFileReader '%s' sid %u\n", b2->data, *sid);
 #endif
@@ -592,6 +1608,182 @@ producer_produceToken_bioFileReader (TokenType* tt, struct B2 * b2) {
   }
 }
 
+// Fill the run of slots with lines of the file, stopping after the
+// end-of-transmission token.
+static size_t
+producer_produceTokens_bioFileReader (TokenType* slots, size_t n, struct B2 * b2) {
+  TokenType* initToken = (TokenType*)b2->producer.tokens2produce.in;
+  size_t i = 0;
+
+  if (initToken->tt_this.sid == 0) { // wait until b2 is closed
+    producer_produceToken_bioFileReader(slots, b2);
+    return 0;
+  }
+  while (i < n && initToken->tt_this.sid)
+    producer_produceToken_bioFileReader(slots + i++, b2);
+  return i;
+}
+
+// The mmapFileReader maps the file and produces a token per line, the
+// TokenRef of the line in place, with no copying and no line length limit.
+// The mapping pointer takes the place of the bioFileReader's FILE* in the
+// initToken (the writers check it when copying), followed by the sid and the
+// offset of the next line.
+struct MmapInit {
+  int fd; // of the bioFileWriter
+  const char* map;
+  unsigned int sid;
+  size_t offset;
+} __attribute__((packed));
+
+// Map the file on the main thread, so that open() throws when it cannot be
+// mapped; a reopened b2 maps it anew, see B2T_Open.
+static int producer_openSockets_mmapFileReader (struct B2 * b2, char* error,
+    size_t errorSize) {
+  const char* failed = NULL;
+  void* mapped = MAP_FAILED;
+  char path[sizeof(b2->data)];
+  size_t length = strcspn(b2->data, "\n"); // see configure_b2
+  struct stat st;
+  int fd, err = 0;
+
+  memcpy(path, b2->data, length);
+  path[length] = '\0';
+  if (b2->producer.mapped) { // no token of the previous open refers to it
+    munmap((void*)b2->producer.mapped, mappedLength(b2));
+    b2->producer.mapped = NULL;
+  }
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) failed = "open";
+  else if (fstat(fd, &st) == -1) failed = "fstat";
+  else {
+    b2->producer.mappedSize = st.st_size;
+    mapped = mmap(NULL, mappedLength(b2), PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) failed = "mmap";
+  }
+  if (failed) err = errno;
+  if (fd != -1 && close(fd) == -1 && !failed) {
+    failed = "close";
+    err = errno;
+    munmap(mapped, mappedLength(b2));
+  }
+  if (failed) {
+    snprintf(error, errorSize, "%s %s: %s", failed, path, strerror(err));
+    return -1;
+  }
+  b2->producer.mapped = mapped;
+  madvise(mapped, mappedLength(b2), MADV_SEQUENTIAL);
+#ifdef DEBUG_PRINTF
+  printf("producer_openSockets_mmapFileReader '%s' %zu bytes\n",
+      path, (size_t)st.st_size);
+#endif
+  return 0;
+}
+
+static void producer_initOnOpen_mmapFileReader (struct B2 * b2) {
+  initOnOpen(b2);
+  TokenType* initToken = (TokenType*)b2->producer.tokens2produce.in;
+  const char ** map = (const char **)
+    (initToken->theMessage + offsetof(struct MmapInit, map));
+  size_t * offset = (size_t *)
+    (initToken->theMessage + offsetof(struct MmapInit, offset));
+
+  *offset = 0;
+  *map = b2->producer.mapped; // by producer_openSockets_mmapFileReader
+}
+
+// Fill the run of slots with the TokenRefs of the lines, memchr finding the
+// line ends; stop after the end-of-transmission token.
+static size_t
+producer_produceTokens_mmapFileReader (TokenType* slots, size_t n,
+    struct B2 * b2) {
+  TokenType* initToken = (TokenType*)b2->producer.tokens2produce.in;
+  unsigned int * sid = (unsigned int *)
+    (initToken->theMessage + offsetof(struct MmapInit, sid));
+  size_t * offset = (size_t *)
+    (initToken->theMessage + offsetof(struct MmapInit, offset)), i;
+  const char * m = b2->producer.mapped, * end, * nl;
+  TokenRef* ref;
+
+  if (initToken->tt_this.sid == 0) { // wait until b2 is closed
+    waitForClose(b2);
+    return 0;
+  }
+  end = m + b2->producer.mappedSize;
+  for (i = 0; i < n; i++) {
+    ref = (TokenRef*)slots[i].theMessage;
+    slots[i].tt_this.sid = (*sid)++;
+    *((char *)&slots[i].theDelay) = '\0';
+    ref->offset = *offset;
+    if (m + *offset == end) { // produce eot
+      ref->size = 0;
+      *((char *)&slots[i].theDelay) = '\004';
+      initToken->tt_this.sid = 0;
+      return i + 1;
+    }
+    nl = memchr(m + *offset, '\n', end - (m + *offset));
+    ref->size = (nl ? nl + 1 : end) - (m + *offset);
+    *offset += ref->size;
+  }
+  return i;
+}
+
+static void
+producer_produceToken_mmapFileReader (TokenType* tt, struct B2 * b2) {
+  producer_produceTokens_mmapFileReader(tt, 1, b2);
+}
+
+// Produce a record per line of the file; lines longer than recordSizeMax(b2)
+// are split. The line buffer lives in initToken->theMessage after the sid.
+static void producer_produceRecord_bioFileReader (struct B2 * b2) {
+  TokenType* initToken = (TokenType*)b2->producer.tokens2produce.in;
+  FILE ** fpp = (FILE **)(initToken->theMessage + sizeof(int));
+  unsigned int * sid = (unsigned int *)
+    (initToken->theMessage + sizeof(int) + sizeof(FILE *));
+  char ** line = (char **)(initToken->theMessage + 2 * sizeof(FILE *));
+  size_t * lineSize = (size_t *)(line + 1), size;
+  ssize_t n;
+  char * m;
+  RecordType* r;
+
+  if (initToken->tt_this.sid == 0) { // wait until b2 is closed
+    waitForClose(b2);
+    return;
+  }
+  if ((n = getline(line, lineSize, *fpp)) == -1) { // produce eot
+    if (ferror(*fpp)) perror("producer_produceRecord_bioFileReader");
+#ifdef DEBUG_PRINTF
+    else printf("producer_produceRecord_bioFileReader closing on EOF\n");
+#endif
+    initToken->tt_this.sid = 0;
+    fclose(*fpp);
+    free(*line);
+    if ((r = reserveRecord(b2, 0)) == NULL) return;
+    r->sid = (*sid)++;
+    r->size = 0;
+    r->theMessage[0] = '\0';
+    r->theDelay = 0ll;
+    *((char *)&r->theDelay) = '\004';
+    commitRecord(b2, r);
+    return;
+  }
+  for (m = *line; n > 0; m += size, n -= size) {
+    size = (size_t)n < recordSizeMax(b2) ? (size_t)n : recordSizeMax(b2);
+    if ((r = reserveRecord(b2, size)) == NULL) break;
+    r->sid = (*sid)++;
+    r->size = size;
+    r->theDelay = 0ll;
+    memcpy(r->theMessage, m, size);
+    r->theMessage[size] = '\0';
+    commitRecord(b2, r);
+  }
+  if (b2->isOpen) return;
+
+  // Closed before EOF: this is the last call.
+  initToken->tt_this.sid = 0;
+  fclose(*fpp);
+  free(*line);
+}
+
 static void producer_cleanupOnClose_bioFileReader (struct B2 * b2) {
 }
 
@@ -625,6 +1817,49 @@ producer_produceToken_sidSetter (TokenType* tt, struct B2 * b2) {
 #endif
 }
 
+// Fill the run of slots with sids, stopping after the end-of-transmission token.
+static size_t
+producer_produceTokens_sidSetter (TokenType* slots, size_t n, struct B2 * b2) {
+  TokenType* initToken = (TokenType*)b2->producer.tokens2produce.in;
+  size_t i = 0;
+
+  if (initToken->tt_this.sid == 0) { // wait until b2 is closed
+    producer_produceToken_sidSetter(slots, b2);
+    return 0;
+  }
+  while (i < n && initToken->tt_this.sid)
+    producer_produceToken_sidSetter(slots + i++, b2);
+  return i;
+}
+
+static void producer_produceRecord_sidSetter (struct B2 * b2) {
+  TokenType* initToken = (TokenType*)b2->producer.tokens2produce.in;
+  RecordType* r;
+
+  if (initToken->tt_this.sid == 0) { // wait until b2 is closed
+    waitForClose(b2);
+    return;
+  }
+  if ((r = reserveRecord(b2, 0)) == NULL) return;
+  r->sid = FILESIZE - initToken->tt_this.sid--;
+  r->size = 0;
+  r->theMessage[0] = '\0';
+
+  // If this record is the last one, set the end-of-transmission
+  // indicator in r->theDelay.
+  r->theDelay = 0ll;
+  *((char *)&r->theDelay) = initToken->tt_this.sid == 0 ? '\004' : '\0';
+  commitRecord(b2, r);
+}
+
+// Close the b2 internally on the end-of-transmission token.
+static inline void closeOnEot (struct B2 * b2) {
+  uv_mutex_lock(&b2->tokenProducingMutex);
+  b2->isOpen = 0;
+  uv_cond_signal(&b2->tokenProducing);
+  uv_mutex_unlock(&b2->tokenProducingMutex);
+}
+
 static void
 consumer_consumeToken_bioFileWriter (TokenType* tt, struct B2 * b2) {
   TokenType* initToken = (TokenType*)b2->producer.tokens2produce.in;
@@ -644,27 +1879,59 @@ check_fpp_eot:
   if (*fpp && eot) goto check_eot;
   
   // Write theMessage.
-  ssize_t written = write(*fd, tt->theMessage, strlen(tt->theMessage));
-  assert((ssize_t)strlen(tt->theMessage) ==  written);
+  size_t size;
+  const char* m = tokenMessage(b2, tt, &size);
+  bufferBio(b2, *fd, m, size);
 
 check_eot:
   if (eot) { // close the b2 internally
 #ifdef DEBUG_PRINTF
     printf("consumer_consumeToken_bioFileWriter eot %d\n", eot);
 #endif
-    uv_mutex_lock(&b2->tokenProducingMutex);
-    b2->isOpen = 0;
-    uv_cond_signal(&b2->tokenProducing);
-    uv_mutex_unlock(&b2->tokenProducingMutex);
+    closeOnEot(b2);
   }
 }
 
-static void consumer_initOnOpen_bioFileWriter (struct B2 * b2) {
+// Write the record's theMessage when copying a file, or its sid and delay
+// otherwise.
+static void
+consumer_consumeRecord_bioFileWriter (RecordType* r, struct B2 * b2) {
+  TokenType* initToken = (TokenType*)b2->producer.tokens2produce.in;
+  int * fd = (int *) initToken->theMessage;
+  char eot = *((char *)&r->theDelay); // the end-of-transmission indicator
+  FILE ** fpp = (FILE **)(initToken->theMessage + sizeof(int));
+  char msg[128], * m = r->theMessage;
+  size_t size = r->size;
+
+  if (*fpp == NULL)
+    size = sprintf(m = msg, "sid %u, ∆ %lldµs\n", r->sid,
+        nowUs() - initToken->theDelay);
+  if (size) bufferBio(b2, *fd, m, size);
+  if (eot) closeOnEot(b2);
+}
+
+// Drain the run of slots; the end-of-transmission token closes the b2 and
+// ends the run.
+static size_t
+consumer_consumeTokens_bioFileWriter (TokenType* slots, size_t n, struct B2 * b2) {
+  size_t i = 0;
+
+  while (i < n && b2->isOpen)
+    consumer_consumeToken_bioFileWriter(slots + i++, b2);
+  return i;
+}
+
+// Wait for the producer to set the initToken up (see configure_b2).
+static inline TokenType* waitForInitToken (struct B2 * b2) {
   uv_mutex_lock(&b2->tokenProducingMutex);
-  while (fifoEmpty(&b2->producer.tokens2produce))
+  while (mpscEmpty(&b2->producer.tokens2produce))
     uv_cond_wait(&b2->tokenProducing, &b2->tokenProducingMutex);
   uv_mutex_unlock(&b2->tokenProducingMutex);
-  TokenType* initToken = (TokenType*)b2->producer.tokens2produce.in;
+  return (TokenType*)b2->producer.tokens2produce.in;
+}
+
+static void consumer_initOnOpen_bioFileWriter (struct B2 * b2) {
+  TokenType* initToken = waitForInitToken(b2);
   int * fd = (int *) initToken->theMessage;
 #ifdef DEBUG_PRINTF
   FILE ** fpp = (FILE **)(initToken->theMessage + sizeof(int));
@@ -673,6 +1940,9 @@ static void consumer_initOnOpen_bioFileWriter (struct B2 * b2) {
 
   file += strlen(file) + 1;
   *fd = open(file, O_CREAT|O_WRONLY, 0600);
+  b2->consumer.sink = malloc(sizeof(struct BioSink) + b2->consumer.flushThreshold);
+  assert(b2->consumer.sink);
+  ((struct BioSink *)b2->consumer.sink)->size = 0;
 #ifdef DEBUG_PRINTF
   printf("consumer_initOnOpen_bioFileWriter '%s' %d%s\n", 
       file, *fd, *fpp ? ", copying" : "");
@@ -680,234 +1950,1536 @@ static void consumer_initOnOpen_bioFileWriter (struct B2 * b2) {
 }
 
 static void consumer_initOnOpen_default (struct B2 * b2) {
-}
-
-const char udpPort[] = "3000";
-int efd;
-char buf[128];
-
-static void udpFile (char* f, int socketFd, struct sockaddr * pa, socklen_t pal) {
-  FILE * fp = fopen(f, "r");
-  size_t count = 0;
-  uint64_t u;
-
-  while (fgets(buf, sizeof(buf), fp)) {
-    assert(sizeof(uint64_t) == read(efd, &u, sizeof(uint64_t)));
-    assert((ssize_t)strlen(buf) == sendto(socketFd, buf, strlen(buf), 0, pa, pal)); 
-    count++;
+  b2->consumer.inFlight = 0;
+  if (b2->consumer.batches) { // the 'tokens' event has a listener
+    b2->consumer.window = 1;
+    b2->consumer.consumeTokens = consumer_consumeTokens_default;
+    b2->consumer.consumeRecords = consumer_consumeRecords_default;
   }
-
-  if (ferror(fp)) {
-    perror("udpFile fgets"); fclose(fp); exit(1);
+  else if (b2->consumer.runs) { // the 'run' event has a listener
+    b2->consumer.window = 1;
+    b2->consumer.consumeTokens = consumer_consumeTokens_run;
+    b2->consumer.consumeRecords = consumer_consumeRecords_run;
   }
-  else if (feof(fp)) fclose(fp);
-  else {
-    fprintf(stderr, "\n\nUNEXPECTED\n\n\n"); exit(1);
+  else if (b2->consumer.window > 1) {
+    b2->consumer.consumeTokens = consumer_consumeTokens_window;
+    b2->consumer.consumeRecords = consumer_consumeRecords_window;
   }
-#ifdef DEBUG_PRINTF
-  printf("\nudpFile count %zu\n", count);
-#endif
 }
 
-/* static */ pid_t forkUDPserver () {
-  uint64_t u = 1;
-  pid_t cpid = fork();
+// A file read in chunks: the file readers split buffer[pos, size) into
+// fgets-like tokens, up to and including '\n', at most 127 bytes; refill moves
+// on to the next chunk and returns false at the end of the file. A file
+// reader keeps the pointer to its LineSource in place of the bioFileReader's
+// FILE* in the initToken (the writers check it when copying), followed by
+// the sid.
+struct LineSource {
+  const char* buffer;
+  size_t pos, size;
+  bool (*refill) (struct LineSource* s);
+};
 
-  switch (cpid) {
-    case -1: perror("fork"); exit(1);
-    case  0: break;
-    default: 
-             assert(sizeof(uint64_t) == read(efd, &u, sizeof(uint64_t)));
-             return cpid;
-  }
-  int socketFd = udpFdBnd(udpPort, 0);
-  ssize_t nread;
-  struct sockaddr_storage peer_addr;
-  socklen_t peer_addr_len = sizeof(struct sockaddr_storage);
-#ifdef DEBUG_PRINTF
-  printf("forkUDPserver is listening for command on udpPort %s\n", udpPort);
-#endif
-  assert(sizeof(uint64_t) == write(efd, &u, sizeof(uint64_t))); // parent
-                                                                // notified
-  nread = recvfrom(socketFd, buf, 128, 0,
-      (struct sockaddr *) &peer_addr, &peer_addr_len);
-  assert(0 < nread);
-  buf[nread] = '\0';
+// Fill the run of slots with the lines of s, stopping after the
+// end-of-transmission token.
+static size_t produceLines (TokenType* slots, size_t n, struct B2 * b2) {
+  TokenType* initToken = (TokenType*)b2->producer.tokens2produce.in;
+  unsigned int * sid = (unsigned int *)
+    (initToken->theMessage + sizeof(int) + sizeof(struct LineSource *));
+  struct LineSource * s = (struct LineSource *)b2->producer.source;
+  size_t i, len, m, max = sizeof(slots->theMessage) - 1;
+  const char * c, * nl;
+  TokenType * tt;
 
-  char host[NI_MAXHOST], service[NI_MAXSERV];
-  int s = getnameinfo((struct sockaddr *) &peer_addr, peer_addr_len,
-      host, NI_MAXHOST, service, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV);
-  if (s == 0) {
-#ifdef DEBUG_PRINTF
-    printf("forkUDPserver received %ld bytes from %s:%s '%s'\n", 
-        nread, host, service, buf);
-#endif
-    udpFile(buf, socketFd, (struct sockaddr *) &peer_addr, peer_addr_len);
+  if (initToken->tt_this.sid == 0) { // wait until b2 is closed
+    waitForClose(b2);
+    return 0;
+  }
+  for (i = 0; i < n; i++) {
+    tt = slots + i;
+    for (len = 0; len < max; len += m, s->pos += m) {
+      m = 0;
+      if (s->pos == s->size && !s->refill(s)) break;
+      if (s->pos == s->size) continue; // an empty chunk
+      c = s->buffer + s->pos;
+      m = s->size - s->pos < max - len ? s->size - s->pos : max - len;
+      if ((nl = memchr(c, '\n', m))) m = nl + 1 - c;
+      memcpy(tt->theMessage + len, c, m);
+      if (nl) {
+        len += m;
+        s->pos += m;
+        break;
+      }
+    }
+    tt->theMessage[len] = '\0';
+    tt->tt_this.sid = (*sid)++;
+    *((char *)&tt->theDelay) = '\0';
+    if (len == 0) { // produce eot
+      *((char *)&tt->theDelay) = '\004';
+      initToken->tt_this.sid = 0;
+      return i + 1;
+    }
   }
-  else fprintf(stderr, "getnameinfo: %s; buf '%s'\n", gai_strerror(s), buf);
+  return i;
+}
 
-  assert(0 == close(socketFd));
-#ifdef DEBUG_PRINTF
-  printf("forkUDPserver closed the socket and is exiting\n");
-#endif
-  exit(0);
+static inline void initLineSource (struct B2 * b2, struct LineSource * s,
+    bool (*refill) (struct LineSource* s)) {
+  TokenType* initToken = (TokenType*)b2->producer.tokens2produce.in;
+  struct LineSource ** sp =
+    (struct LineSource **)(initToken->theMessage + sizeof(int));
+
+  s->buffer = NULL;
+  s->pos = s->size = 0;
+  s->refill = refill;
+  b2->producer.source = *sp = s;
 }
 
-// Reading a regular file from the hard drive is not permitted with epoll.
-// To use epoll, we fork a UDP server process that will have file read after
-// this producer asks it to do so. Then this producer will get the file data
-// via UDP with epoll.
-static void producer_initOnOpen_epollFileReader (struct B2 * b2) {
 #ifdef __gnu_linux__
-#ifdef DEBUG_PRINTF
-  printf("producer_initOnOpen_epollFileReader using %zu bytes of theMessage\n",
-      sizeof(int) + // fd of the bigfileCopy
-      sizeof(int) + // epollfd
-      sizeof(int)   // sid
-      ); // 24
-#endif
-  initOnOpen(b2);
-  TokenType* initToken = (TokenType*)b2->producer.tokens2produce.in;
+// Reading a regular file from the hard drive is not permitted with epoll.
+// To use epoll, the feeder thread splices the file into a pipe; the producer
+// waits with epoll for the pipe to become readable, drains whatever is
+// readable and splits it into tokens.
+#define PIPE_CHUNK 65536
+
+struct PipeReader {
+  struct LineSource lines;
+  int file, pipe[2], epollfd;
+  int wakeFd; // of the b2, in the epoll set too
+  uv_thread_t feederThread;
+  char buffer[PIPE_CHUNK];
+};
 
-  int * epollfd = (int *)(initToken->theMessage + sizeof(int));
-  *epollfd = epoll_create1(0); 
-  assert(-1 != *epollfd);
+// Splice the file to the pipe; a FIFO or another slow file is non-blocking,
+// so that the feeder waits for it with poll, along with the wakeFd.
+static void feedPipe (void* data) {
+  struct PipeReader* r = (struct PipeReader *)data;
+  struct pollfd fds[2] = {
+    { r->file, POLLIN, 0 }, { r->wakeFd, POLLIN, 0 }
+  };
+  ssize_t n;
+
+  for (;;) {
+    if ((n = splice(r->file, NULL, r->pipe[1], NULL, PIPE_CHUNK,
+            SPLICE_F_MOVE | SPLICE_F_MORE)) > 0) continue;
+    if (n == -1 && errno == EINTR) continue;
+    if (n == -1 && errno == EAGAIN) {
+      if (-1 == poll(fds, 2, -1)) assert(errno == EINTR);
+      if (fds[1].revents) break; // B2T_Close
+      continue;
+    }
+    if (n == -1 && errno != EPIPE) perror("feedPipe splice");
+    break;
+  }
+  assert(0 == close(r->pipe[1])); // the producer gets EOF
+}
 
-  assert(-1 < (efd = eventfd(0, 0)));
-  unsigned int * sid = (unsigned int *)(epollfd + sizeof(int));
-  *sid = 0;
-  forkUDPserver();
+static bool refillPipe (struct LineSource* s) {
+  struct PipeReader* r = (struct PipeReader *)s;
+  struct epoll_event ee;
+  ssize_t n;
+
+  for (;;) {
+    if ((n = read(r->pipe[0], r->buffer, PIPE_CHUNK)) >= 0) {
+      s->buffer = r->buffer;
+      s->pos = 0;
+      s->size = n;
+      return n > 0;
+    }
+    if (errno == EINTR) continue;
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      perror("refillPipe read");
+      return false;
+    }
+    if (-1 == epoll_wait(r->epollfd, &ee, 1, -1)) {
+      if (errno == EINTR) continue;
+      perror("refillPipe epoll_wait");
+      return false;
+    }
+    if (ee.data.fd == r->wakeFd) return false; // B2T_Close
+  }
+}
 
+static void producer_initOnOpen_epollFileReader (struct B2 * b2) {
+  struct PipeReader* r = malloc(sizeof(struct PipeReader));
   struct epoll_event ee;
+
+  assert(r);
+  initOnOpen(b2);
+  initLineSource(b2, &r->lines, refillPipe);
+  r->file = takeFile(b2);
+  assert(0 == fcntl(r->file, F_SETFL, O_NONBLOCK)); // see feedPipe
+  assert(0 == pipe2(r->pipe, O_CLOEXEC));
+  fcntl(r->pipe[1], F_SETPIPE_SZ, 1 << 20); // fewer wakeups, if permitted
+  assert(0 == fcntl(r->pipe[0], F_SETFL, O_NONBLOCK));
+  assert(-1 != (r->epollfd = epoll_create1(0)));
   ee.events = EPOLLIN;
-  ee.data.fd = udpFd("127.0.0.1", udpPort, 0);
+  ee.data.fd = r->pipe[0];
+  assert(0 == epoll_ctl(r->epollfd, EPOLL_CTL_ADD, r->pipe[0], &ee));
+  r->wakeFd = ee.data.fd = b2->producer.wakeFd;
+  assert(0 == epoll_ctl(r->epollfd, EPOLL_CTL_ADD, r->wakeFd, &ee));
+  assert(0 == uv_thread_create(&r->feederThread, feedPipe, r));
 #ifdef DEBUG_PRINTF
-  printf("producer_initOnOpen_epollFileReader localhost:%s %d\n",
-      udpPort, ee.data.fd);
-#endif
-  if (-1 == epoll_ctl(*epollfd, EPOLL_CTL_ADD, ee.data.fd, &ee)) {
-    perror("epoll_ctl: ee.data.fd");
-    exit(9);
-  }
-  assert(strlen(b2->data) == // send filename to the UDP server
-      (size_t)write(ee.data.fd, b2->data, strlen(b2->data)));
-#ifdef DEBUG_PRINTF
-  printf("producer_initOnOpen_epollFileReader command '%s' sent\n", b2->data);
-#endif
+  printf("producer_initOnOpen_epollFileReader '%s'\n", b2->data);
 #endif
 }
 
 static void
 producer_produceToken_epollFileReader (TokenType* tt, struct B2 * b2) {
-#ifdef __gnu_linux__
-  TokenType* initToken = (TokenType*)b2->producer.tokens2produce.in;
-  int * epollfd = (int *)(initToken->theMessage + sizeof(int));
-  unsigned int * sid = (unsigned int *)(epollfd + sizeof(int));
-  uint64_t u = 1;
-  struct epoll_event events[1];
-
-  if (*sid == FILESIZE + 1) { // wait until b2 is closed, then return
-    uv_mutex_lock(&b2->tokenProducingMutex);
-    while (b2->isOpen) uv_cond_wait(&b2->tokenProducing, &b2->tokenProducingMutex);
-    uv_mutex_unlock(&b2->tokenProducingMutex);
-#ifdef DEBUG_PRINTF
-    printf("producer_produceToken_epollFileReader is being closed\n");
-#endif
-    return;
-  }
-  if ((tt->tt_this.sid = (*sid)++) == FILESIZE) { // set eot and return
-    *((char *)&tt->theDelay) = '\004';
-    return;
-  }
-  assert(sizeof(uint64_t) == write(efd, &u, sizeof(uint64_t))); // child
-                                                                // notified
-  int nfds = epoll_wait(*epollfd, events, 1, -1);
-  assert(1 == nfds);
-
-  ssize_t nread = read(events->data.fd, tt->theMessage, sizeof(tt->theMessage));
-  tt->theMessage[nread] = '\0';
-  *((char *)&tt->theDelay) = '\0';
-  if (*sid == FILESIZE) close(events->data.fd);
-#endif
+  produceLines(tt, 1, b2);
 }
 
+// Closing the read end of the pipe stops the feeder thread early, if the b2
+// is closed before the end of the file.
 static void producer_cleanupOnClose_epollFileReader (struct B2 * b2) {
-#ifdef __gnu_linux__
-#endif
+  struct PipeReader* r = (struct PipeReader *)b2->producer.source;
+
+  assert(0 == close(r->pipe[0]));
+  assert(0 == uv_thread_join(&r->feederThread));
+  assert(0 == close(r->epollfd));
+  assert(0 == close(r->file));
+  free(r);
+  b2->producer.source = NULL;
+}
+#else
+static void producer_initOnOpen_epollFileReader (struct B2 * b2) {
 }
 
-static void consumer_initOnOpen_epollFileWriter (struct B2 * b2) {
-#ifdef __gnu_linux__
-#endif
+static void
+producer_produceToken_epollFileReader (TokenType* tt, struct B2 * b2) {
 }
 
-static void consumer_cleanupOnClose_epollFileWriter (struct B2 * b2) {
-#ifdef __gnu_linux__
-#endif
+static void producer_cleanupOnClose_epollFileReader (struct B2 * b2) {
 }
+#endif
 
-static void
-consumer_consumeToken_epollFileWriter (TokenType* tt, struct B2 * b2) {
 #ifdef __gnu_linux__
+// The epollFileWriter never blocks in write(): it appends the tokens to its
+// output buffer, writes as much of it as the sink takes at the end of each
+// run, and waits with epoll for the sink to become writable, or for the
+// wakeFd of the b2 (B2T_Close), only when the buffer is full. A regular file
+// cannot be used with epoll and does not block anyway, so it is written
+// blocking.
+#define SINK_BUFSIZE 65536
+
+struct EpollSink {
+  int fd, epollfd; // the sink, non-blocking unless a regular file
+  int wakeFd; // of the b2, in the epoll set too
+  size_t head, tail; // of the buffered bytes
+  char buffer[SINK_BUFSIZE];
+};
+
+// Write the buffered bytes to the sink. Unless all is set, stop when the
+// sink would block; otherwise wait for it with epoll until the buffer is
+// empty or the b2 is closed. Returns false if the b2 is closed.
+static bool flushSink (struct EpollSink* s, bool all, struct B2 * b2) {
+  struct epoll_event ee;
+  ssize_t n;
+
+  while (s->head < s->tail) {
+    if ((n = write(s->fd, s->buffer + s->head, s->tail - s->head)) > 0) {
+      s->head += n;
+      continue;
+    }
+    assert(n == -1);
+    if (errno == EINTR) continue;
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      perror("flushSink write");
+      s->head = s->tail; // drop the output
+      break;
+    }
+    if (!all) return true;
+    if (!b2->isOpen) return false;
+    if (-1 == (n = epoll_wait(s->epollfd, &ee, 1, -1)) && errno != EINTR) {
+      perror("flushSink epoll_wait");
+      return false;
+    }
+    if (n == 1 && ee.data.fd == s->wakeFd) return false; // B2T_Close
+  }
+  s->head = s->tail = 0;
+  return true;
+}
+
+// Append size bytes of m to the output buffer, flushing it when full.
+static void appendSink (struct EpollSink* s, const char* m, size_t size,
+    struct B2 * b2) {
+  size_t room;
+
+  while (size) {
+    if ((room = SINK_BUFSIZE - s->tail) == 0) {
+      if (!flushSink(s, true, b2)) return;
+      continue;
+    }
+    if (room > size) room = size;
+    memcpy(s->buffer + s->tail, m, room);
+    s->tail += room;
+    m += room;
+    size -= room;
+  }
+}
+
+// Open the sink on the main thread, so that open() throws when it cannot be
+// opened. A FIFO is opened non-blocking, so that a FIFO without a reader
+// fails with ENXIO rather than blocking B2T_Open; a regular file then gets
+// the flag cleared.
+static int consumer_openSockets_epollFileWriter (struct B2 * b2, char* error,
+    size_t errorSize) {
+  const char* file = b2->data + strcspn(b2->data, "\n") + 1; // configure_b2
+  const char* failed = NULL;
+  struct EpollSink* s;
+  struct epoll_event ee;
+  struct stat st;
+  int fd, err;
+
+  if ((fd = open(file, O_CREAT|O_WRONLY|O_NONBLOCK|O_CLOEXEC, 0600)) == -1)
+    failed = "open";
+  else if (fstat(fd, &st) == -1) failed = "fstat";
+  else if (S_ISREG(st.st_mode) && fcntl(fd, F_SETFL, 0) == -1)
+    failed = "fcntl";
+  if (failed) {
+    err = errno;
+    if (fd != -1) close(fd);
+    snprintf(error, errorSize, "%s %s: %s", failed, file, strerror(err));
+    return -1;
+  }
+  assert((s = malloc(sizeof(struct EpollSink))));
+  s->head = s->tail = 0;
+  s->fd = fd;
+  assert(-1 != (s->epollfd = epoll_create1(EPOLL_CLOEXEC)));
+  if (!S_ISREG(st.st_mode)) { // a FIFO, a socket or a character device
+    ee.events = EPOLLOUT;
+    ee.data.fd = s->fd;
+    assert(0 == epoll_ctl(s->epollfd, EPOLL_CTL_ADD, s->fd, &ee));
+  }
+  ee.events = EPOLLIN;
+  s->wakeFd = ee.data.fd = b2->consumer.wakeFd;
+  assert(0 == epoll_ctl(s->epollfd, EPOLL_CTL_ADD, s->wakeFd, &ee));
+  b2->consumer.sink = s;
+#ifdef DEBUG_PRINTF
+  printf("consumer_openSockets_epollFileWriter '%s' %d%s\n",
+      file, fd, S_ISREG(st.st_mode) ? ", blocking" : "");
+#endif
+  return 0;
+}
+
+static void consumer_initOnOpen_epollFileWriter (struct B2 * b2) {
+  TokenType* initToken = waitForInitToken(b2);
+
+  *(int *) initToken->theMessage = ((struct EpollSink *)b2->consumer.sink)->fd;
+}
+
+static void consumer_cleanupOnClose_epollFileWriter (struct B2 * b2) {
+  struct EpollSink* s = (struct EpollSink *)b2->consumer.sink;
+
+  // The b2 is closed, so flushSink would drop the rest of the buffer if the
+  // sink blocked: write it blocking.
+  assert(0 == fcntl(s->fd, F_SETFL, 0));
+  flushSink(s, true, b2);
+  assert(0 == close(s->epollfd));
+  assert(0 == close(s->fd));
+  free(s);
+  b2->consumer.sink = NULL;
+  reportWritten(b2);
+#ifdef DEBUG_PRINTF
+  printf("consumer_cleanupOnClose_epollFileWriter\n");
+#endif
+}
+
+// Buffer theMessage when copying a file, or the sid and the delay otherwise,
+// like consumer_consumeToken_bioFileWriter does. Returns the eot indicator.
+static char bufferToken_epollFileWriter (TokenType* tt, struct B2 * b2) {
+  TokenType* initToken = (TokenType*)b2->producer.tokens2produce.in;
+  char eot = *((char *)&tt->theDelay); // the end-of-transmission indicator
+  FILE ** fpp = (FILE **)(initToken->theMessage + sizeof(int));
+  char msg[128];
+  const char* m;
+  size_t size;
+
+  if (*fpp == NULL)
+    appendSink(b2->consumer.sink, msg, sprintf(msg, "sid %d, ∆ %lldµs\n",
+          tt->tt_this.sid, nowUs() - initToken->theDelay), b2);
+  else if (!eot) {
+    m = tokenMessage(b2, tt, &size);
+    appendSink(b2->consumer.sink, m, size, b2);
+  }
+  return eot;
+}
+
+// Buffer the run of slots, then write what the sink takes without waiting.
+// The end-of-transmission token flushes the buffer, closes the b2 and ends
+// the run.
+static size_t
+consumer_consumeTokens_epollFileWriter (TokenType* slots, size_t n,
+    struct B2 * b2) {
+  size_t i = 0;
+
+  while (i < n && b2->isOpen) {
+    if (bufferToken_epollFileWriter(slots + i++, b2)) {
+      flushSink(b2->consumer.sink, true, b2);
+      closeOnEot(b2);
+      return i;
+    }
+  }
+  flushSink(b2->consumer.sink, false, b2);
+  return i;
+}
+
+static void
+consumer_consumeToken_epollFileWriter (TokenType* tt, struct B2 * b2) {
+  consumer_consumeTokens_epollFileWriter(tt, 1, b2);
+}
+
+static size_t
+consumer_consumeRecords_epollFileWriter (RecordType* r, size_t n,
+    struct B2 * b2) {
+  TokenType* initToken = (TokenType*)b2->producer.tokens2produce.in;
+  FILE ** fpp = (FILE **)(initToken->theMessage + sizeof(int));
+  char msg[128];
+  size_t i;
+
+  for (i = 0; i < n && b2->isOpen; i++, r = nextRecord(r)) {
+    if (*fpp == NULL)
+      appendSink(b2->consumer.sink, msg, sprintf(msg, "sid %u, ∆ %lldµs\n",
+            r->sid, nowUs() - initToken->theDelay), b2);
+    else appendSink(b2->consumer.sink, r->theMessage, r->size, b2);
+    if (*((char *)&r->theDelay)) { // the end-of-transmission indicator
+      flushSink(b2->consumer.sink, true, b2);
+      closeOnEot(b2);
+      return i + 1;
+    }
+  }
+  flushSink(b2->consumer.sink, false, b2);
+  return i;
+}
+
+static void
+consumer_consumeRecord_epollFileWriter (RecordType* r, struct B2 * b2) {
+  consumer_consumeRecords_epollFileWriter(r, 1, b2);
+}
+#else
+static void consumer_initOnOpen_epollFileWriter (struct B2 * b2) {
+}
+
+static void consumer_cleanupOnClose_epollFileWriter (struct B2 * b2) {
+}
+
+static void
+consumer_consumeToken_epollFileWriter (TokenType* tt, struct B2 * b2) {
+}
+#define consumer_consumeTokens_epollFileWriter 0
+#define consumer_consumeRecord_epollFileWriter 0
+#define consumer_consumeRecords_epollFileWriter 0
+#define consumer_openSockets_epollFileWriter 0
+#endif
+
+#ifdef __gnu_linux__
+// The uringFileReader keeps URING_DEPTH chunk reads of the file in flight
+// with io_uring and splits the chunks into tokens in the file order.
+struct UringReader {
+  struct LineSource lines;
+  struct Uring u;
+  int fd;
+  unsigned chunk; // the chunk being split, chunk % URING_DEPTH is its buffer
+};
+
+// Move on to the next chunk, reusing the buffer of this one for the read of
+// the chunk URING_DEPTH ahead. A short read is requeued for the rest of the
+// chunk, so that only a read of 0 bytes (or an error) leaves a chunk short:
+// the last one. Returns false at the end of the file.
+static bool nextChunk (struct LineSource* s) {
+  struct UringReader* r = (struct UringReader *)s;
+  unsigned i = r->chunk % URING_DEPTH;
+  size_t size = 0;
+  int res;
+
+  if (s->buffer && s->size < URING_CHUNK) return false; // the last one
+  if (s->buffer) {
+    uringQueue(&r->u, IORING_OP_READ_FIXED, r->fd, i, URING_CHUNK,
+        (off_t)(r->chunk + URING_DEPTH) * URING_CHUNK);
+    i = ++r->chunk % URING_DEPTH;
+  }
+  for (;;) {
+    uringWait(&r->u, i);
+    if ((res = r->u.res[i]) < 0) {
+      if (res == -EINTR || res == -EAGAIN) res = 0; // read it again
+      else {
+        errno = -res;
+        perror("nextChunk read");
+        break;
+      }
+    }
+    else if (res == 0) break; // the end of the file
+    if ((size += res) == URING_CHUNK) break;
+    uringQueueAt(&r->u, IORING_OP_READ_FIXED, r->fd, i, size,
+        URING_CHUNK - size, (off_t)r->chunk * URING_CHUNK + size);
+  }
+  s->buffer = uringChunk(&r->u, i);
+  s->pos = 0;
+  s->size = size;
+  return true;
+}
+
+static void producer_initOnOpen_uringFileReader (struct B2 * b2) {
+  struct UringReader * r = malloc(sizeof(struct UringReader));
+  unsigned i;
+
+  assert(r);
+  initOnOpen(b2);
+  initLineSource(b2, &r->lines, nextChunk);
+  r->fd = takeFile(b2);
+  uringInit(&r->u);
+  for (i = 0; i < URING_DEPTH; i++) // fill the queue, submit once
+    uringQueue(&r->u, IORING_OP_READ_FIXED, r->fd, i, URING_CHUNK,
+        (off_t)i * URING_CHUNK);
+  r->chunk = 0;
+#ifdef DEBUG_PRINTF
+  printf("producer_initOnOpen_uringFileReader '%s' io_uring fd %d\n",
+      b2->data, r->u.fd);
 #endif
 }
 
+static void
+producer_produceToken_uringFileReader (TokenType* tt, struct B2 * b2) {
+  produceLines(tt, 1, b2);
+}
+
+static void producer_cleanupOnClose_uringFileReader (struct B2 * b2) {
+  struct UringReader * r = (struct UringReader *)b2->producer.source;
+
+  uringExit(&r->u);
+  assert(0 == close(r->fd));
+  free(r);
+  b2->producer.source = NULL;
+}
+
+// The uringFileWriter fills its chunk buffers with the tokens (or records)
+// and writes each full chunk with io_uring at its offset of the file, with
+// up to URING_DEPTH chunk writes in flight; it waits only for the write of
+// the chunk buffer it is about to reuse.
+struct UringWriter {
+  struct Uring u;
+  int fd;
+  unsigned chunk; // the chunk being filled, chunk % URING_DEPTH is its buffer
+  size_t fill; // of the chunk being filled
+  size_t size[URING_DEPTH]; // of the chunk written from buffer i
+  off_t offset[URING_DEPTH], next; // of the chunk written, of the next one
+};
+
+// Check the write from buffer i, completing a short one synchronously.
+static void checkChunk (struct UringWriter* w, unsigned i) {
+  int res;
+
+  uringWait(&w->u, i);
+  if ((res = w->u.res[i]) < 0) {
+    errno = -res;
+    perror("checkChunk write");
+  }
+  else if ((size_t)res < w->size[i])
+    assert((ssize_t)(w->size[i] - res) == pwrite(w->fd,
+          uringChunk(&w->u, i) + res, w->size[i] - res, w->offset[i] + res));
+  w->size[i] = 0;
+}
+
+// Write the chunk being filled and wait until the next buffer is free.
+static void writeChunk (struct UringWriter* w) {
+  unsigned i = w->chunk % URING_DEPTH;
+
+  if (w->fill == 0) return;
+  w->size[i] = w->fill;
+  w->offset[i] = w->next;
+  uringQueue(&w->u, IORING_OP_WRITE_FIXED, w->fd, i, w->fill, w->next);
+  uringSubmit(&w->u);
+  w->next += w->fill;
+  w->fill = 0;
+  i = ++w->chunk % URING_DEPTH;
+  if (w->size[i]) checkChunk(w, i); // still in flight, maybe
+}
+
+static void appendChunk (struct UringWriter* w, const char* m, size_t size) {
+  size_t room;
+
+  while (size) {
+    if ((room = URING_CHUNK - w->fill) == 0) {
+      writeChunk(w);
+      continue;
+    }
+    if (room > size) room = size;
+    memcpy(uringChunk(&w->u, w->chunk % URING_DEPTH) + w->fill, m, room);
+    w->fill += room;
+    m += room;
+    size -= room;
+  }
+}
+
+static void consumer_initOnOpen_uringFileWriter (struct B2 * b2) {
+  TokenType* initToken = waitForInitToken(b2);
+  int * fd = (int *) initToken->theMessage;
+  char * file = b2->data;
+  struct UringWriter* w = calloc(1, sizeof(struct UringWriter));
+
+  assert(w);
+  file += strlen(file) + 1;
+  assert(-1 != (*fd = w->fd = open(file, O_CREAT|O_WRONLY, 0600)));
+  uringInit(&w->u);
+  b2->consumer.sink = w;
+#ifdef DEBUG_PRINTF
+  printf("consumer_initOnOpen_uringFileWriter '%s' %d, io_uring fd %d\n",
+      file, *fd, w->u.fd);
+#endif
+}
+
+static void consumer_cleanupOnClose_uringFileWriter (struct B2 * b2) {
+  struct UringWriter* w = (struct UringWriter *)b2->consumer.sink;
+  unsigned i;
+
+  writeChunk(w);
+  for (i = 0; i < URING_DEPTH; i++) if (w->size[i]) checkChunk(w, i);
+  uringExit(&w->u);
+  assert(0 == close(w->fd));
+  free(w);
+  b2->consumer.sink = NULL;
+  reportWritten(b2);
+#ifdef DEBUG_PRINTF
+  printf("consumer_cleanupOnClose_uringFileWriter\n");
+#endif
+}
+
+// Append the run of slots to the chunks, the way the bioFileWriter writes
+// them; the end-of-transmission token closes the b2 and ends the run.
+static size_t
+consumer_consumeTokens_uringFileWriter (TokenType* slots, size_t n,
+    struct B2 * b2) {
+  TokenType* initToken = (TokenType*)b2->producer.tokens2produce.in;
+  FILE ** fpp = (FILE **)(initToken->theMessage + sizeof(int));
+  struct UringWriter* w = (struct UringWriter *)b2->consumer.sink;
+  char msg[128], eot;
+  const char* m;
+  size_t i, size;
+
+  for (i = 0; i < n && b2->isOpen; i++) {
+    eot = *((char *)&slots[i].theDelay); // the end-of-transmission indicator
+    if (*fpp == NULL)
+      appendChunk(w, msg, sprintf(msg, "sid %d, ∆ %lldµs\n",
+            slots[i].tt_this.sid, nowUs() - initToken->theDelay));
+    else if (!eot) {
+      m = tokenMessage(b2, slots + i, &size);
+      appendChunk(w, m, size);
+    }
+    if (eot) {
+      closeOnEot(b2);
+      return i + 1;
+    }
+  }
+  return i;
+}
+
+static void
+consumer_consumeToken_uringFileWriter (TokenType* tt, struct B2 * b2) {
+  consumer_consumeTokens_uringFileWriter(tt, 1, b2);
+}
+
+static size_t
+consumer_consumeRecords_uringFileWriter (RecordType* r, size_t n,
+    struct B2 * b2) {
+  TokenType* initToken = (TokenType*)b2->producer.tokens2produce.in;
+  FILE ** fpp = (FILE **)(initToken->theMessage + sizeof(int));
+  struct UringWriter* w = (struct UringWriter *)b2->consumer.sink;
+  char msg[128];
+  size_t i;
+
+  for (i = 0; i < n && b2->isOpen; i++, r = nextRecord(r)) {
+    if (*fpp == NULL)
+      appendChunk(w, msg, sprintf(msg, "sid %u, ∆ %lldµs\n",
+            r->sid, nowUs() - initToken->theDelay));
+    else appendChunk(w, r->theMessage, r->size);
+    if (*((char *)&r->theDelay)) { // the end-of-transmission indicator
+      closeOnEot(b2);
+      return i + 1;
+    }
+  }
+  return i;
+}
+
+static void
+consumer_consumeRecord_uringFileWriter (RecordType* r, struct B2 * b2) {
+  consumer_consumeRecords_uringFileWriter(r, 1, b2);
+}
+#else
+static void producer_initOnOpen_uringFileReader (struct B2 * b2) {
+}
+
+static void producer_cleanupOnClose_uringFileReader (struct B2 * b2) {
+}
+
+static void
+producer_produceToken_uringFileReader (TokenType* tt, struct B2 * b2) {
+}
+
+static void consumer_initOnOpen_uringFileWriter (struct B2 * b2) {
+}
+
+static void consumer_cleanupOnClose_uringFileWriter (struct B2 * b2) {
+}
+
+static void
+consumer_consumeToken_uringFileWriter (TokenType* tt, struct B2 * b2) {
+}
+#define consumer_consumeTokens_uringFileWriter 0
+#define consumer_consumeRecord_uringFileWriter 0
+#define consumer_consumeRecords_uringFileWriter 0
+#endif
+
+#ifdef __gnu_linux__
+// The netReader ingests the datagrams of the UDP ports and the lines of the
+// TCP connections accepted on the TCP ports listed in b2->data, for example
+// "udp:3001 udp:3002 tcp:3003". All the sockets share one epoll set; up to
+// NET_EVENTS ready sockets are harvested per epoll_wait and each is drained
+// until it would block or the run of slots is full. A datagram or a line (up
+// to and including '\n') becomes a token tagged with its socket in source;
+// the longer ones are truncated (datagrams) or split (lines).
+#define NET_EVENTS 64
+#define NET_BUFFER 65536
+
+enum NetKind { NET_WAKE, NET_UDP, NET_LISTENER, NET_TCP };
+
+struct NetSocket {
+  struct fifo link; // in NetReader.sockets
+  enum NetKind kind;
+  int fd;
+  size_t pos, size; // of the bytes received but not yet produced, NET_TCP
+  char buffer[]; // NET_BUFFER bytes, NET_TCP only
+};
+
+struct NetReader {
+  int epollfd;
+  int spareFd; // closed to accept and drop a connection on EMFILE
+  int ready, next; // events harvested and the next one to drain
+  struct NetSocket* current; // being drained
+  struct fifo sockets;
+  struct NetSocket wake;
+  struct epoll_event events[NET_EVENTS];
+};
+
+static void addSocket (struct NetReader* r, enum NetKind kind, int fd) {
+  size_t size = kind == NET_TCP ? NET_BUFFER : 0;
+  struct NetSocket* s = malloc(sizeof(struct NetSocket) + size);
+  struct epoll_event ee;
+
+  assert(s);
+  if (kind != NET_TCP) // accept4 made it so, the epoll loop never blocks
+    assert(0 == fcntl(fd, F_SETFL, O_NONBLOCK));
+  s->kind = kind;
+  s->fd = fd;
+  s->pos = s->size = 0;
+  ee.events = EPOLLIN;
+  ee.data.ptr = s;
+  assert(0 == epoll_ctl(r->epollfd, EPOLL_CTL_ADD, fd, &ee));
+  fifoIn(&r->sockets, &s->link);
+}
+
+// Close the socket and free it, unlinking it from r->sockets.
+static void dropSocket (struct NetReader* r, struct NetSocket* s) {
+  struct fifo * p = s->link.out, * q = s->link.in;
+
+  p->in = q; q->out = p; r->sockets.size--;
+  assert(0 == close(s->fd)); // which removes it from the epoll set
+  if (r->current == s) r->current = NULL;
+  free(s);
+}
+
+// Receive the next message of the ready sockets into m, at most max bytes,
+// and return its size; its socket goes to *source. With m NULL, return the
+// size of the next message without receiving it. Returns -1 when there are
+// no ready sockets and wait is false, or when the b2 is being closed.
+static ssize_t
+netReceive (struct NetReader* r, char* m, size_t max, int* source, bool wait) {
+  struct NetSocket* s;
+  const char* nl;
+  ssize_t n;
+  int fd;
+
+  for (;;) {
+    if ((s = r->current) == NULL) {
+      if (r->next < r->ready) {
+        r->current = r->events[r->next++].data.ptr;
+        continue;
+      }
+      if (!wait) return -1;
+      r->next = 0;
+      if ((r->ready = epoll_wait(r->epollfd, r->events, NET_EVENTS, -1)) == -1) {
+        assert(errno == EINTR);
+        r->ready = 0;
+      }
+      continue;
+    }
+    switch (s->kind) {
+      case NET_WAKE: // B2T_Close
+        return -1;
+      case NET_LISTENER:
+        if ((fd = accept4(s->fd, NULL, NULL,
+                SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+          addSocket(r, NET_TCP, fd);
+          continue;
+        }
+        if (errno == EINTR || errno == ECONNABORTED) continue;
+        if ((errno == EMFILE || errno == ENFILE) && r->spareFd != -1) {
+          // Out of fds: drop the connection, or the level-triggered
+          // listener stays ready.
+          assert(0 == close(r->spareFd));
+          if ((fd = accept(s->fd, NULL, NULL)) != -1) assert(0 == close(fd));
+          r->spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+          fprintf(stderr, "netReceive: out of fds, connection dropped\n");
+          continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) perror("netReceive");
+        r->current = NULL;
+        continue;
+      case NET_UDP:
+        if ((n = m ? recv(s->fd, m, max, MSG_TRUNC)
+              : recv(s->fd, NULL, 0, MSG_PEEK | MSG_TRUNC)) != -1) {
+          *source = s->fd;
+          return (size_t)n < max ? (size_t)n : max;
+        }
+        r->current = NULL;
+        continue;
+      case NET_TCP:
+        if (max > NET_BUFFER) max = NET_BUFFER;
+        n = s->size - s->pos < max ? s->size - s->pos : max;
+        if ((nl = memchr(s->buffer + s->pos, '\n', n)))
+          n = nl + 1 - (s->buffer + s->pos);
+        if (nl || (size_t)n == max) { // a line, or max bytes of it
+          if (m) {
+            memcpy(m, s->buffer + s->pos, n);
+            s->pos += n;
+          }
+          *source = s->fd;
+          return n;
+        }
+        memmove(s->buffer, s->buffer + s->pos, s->size -= s->pos);
+        s->pos = 0;
+        if ((n = read(s->fd, s->buffer + s->size, NET_BUFFER - s->size)) > 0) {
+          s->size += n;
+          continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+          r->current = NULL;
+          continue;
+        }
+        if (s->size) { // the last line has no '\n'
+          n = s->size;
+          if (m) {
+            memcpy(m, s->buffer, s->size);
+            s->size = 0;
+          }
+          *source = s->fd;
+          return n;
+        }
+        dropSocket(r, s); // closed by the peer
+        continue;
+    }
+  }
+}
+
+// Bind the ports of b2->data on the main thread, see B2T_Open.
+static int
+producer_openSockets_netReader (struct B2 * b2, char* error, size_t errorSize) {
+  struct NetReader * r = malloc(sizeof(struct NetReader));
+  struct epoll_event ee;
+  char ports[sizeof(b2->data)], * port, * save;
+  int fd;
+
+  assert(r);
+  assert(-1 != (r->epollfd = epoll_create1(EPOLL_CLOEXEC)));
+  r->spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  r->ready = r->next = 0;
+  r->current = NULL;
+  fifoInit(&r->sockets);
+  r->wake.kind = NET_WAKE;
+  r->wake.fd = b2->producer.wakeFd;
+  ee.events = EPOLLIN;
+  ee.data.ptr = &r->wake;
+  assert(0 == epoll_ctl(r->epollfd, EPOLL_CTL_ADD, r->wake.fd, &ee));
+  b2->producer.source = r;
+  strcpy(ports, b2->data);
+  for (port = strtok_r(ports, " \n", &save); port;
+      port = strtok_r(NULL, " \n", &save)) {
+    if (strncmp(port, "udp:", 4) == 0 &&
+        (fd = udpFdBnd(port + 4, &b2->udp, error, errorSize)) != -1)
+      addSocket(r, NET_UDP, fd);
+    else if (strncmp(port, "tcp:", 4) == 0 &&
+        (fd = tcpFdLsn(port + 4, &b2->udp, error, errorSize)) != -1)
+      addSocket(r, NET_LISTENER, fd);
+    else {
+      if (strncmp(port, "udp:", 4) && strncmp(port, "tcp:", 4))
+        snprintf(error, errorSize, "expected udp:port or tcp:port, got '%s'",
+            port);
+      b2->producer.cleanupOnClose(b2);
+      return -1;
+    }
+  }
+#ifdef DEBUG_PRINTF
+  printf("producer_openSockets_netReader %zu sockets\n", r->sockets.size);
+#endif
+  return 0;
+}
+
+static void producer_initOnOpen_netReader (struct B2 * b2) {
+  TokenType* initToken;
+
+  initOnOpen(b2);
+  initToken = (TokenType*)b2->producer.tokens2produce.in;
+  *(struct NetReader **)(initToken->theMessage + sizeof(int)) =
+    b2->producer.source;
+}
+
+static size_t
+producer_produceTokens_netReader (TokenType* slots, size_t n, struct B2 * b2) {
+  TokenType* initToken = (TokenType*)b2->producer.tokens2produce.in;
+  unsigned int * sid = (unsigned int *)
+    (initToken->theMessage + sizeof(int) + sizeof(struct NetReader *));
+  struct NetReader * r = (struct NetReader *)b2->producer.source;
+  size_t i, max = sizeof(slots->theMessage) - 1;
+  ssize_t size;
+  TokenType * tt;
+
+  for (i = 0; i < n; i++) {
+    tt = slots + i;
+    if ((size = netReceive(r, tt->theMessage, max, &tt->source, i == 0)) < 0)
+      break;
+    tt->theMessage[size] = '\0';
+    tt->tt_this.sid = (*sid)++;
+    tt->theDelay = 0ll; // no end-of-transmission indicator
+  }
+  return i;
+}
+
+static void
+producer_produceToken_netReader (TokenType* tt, struct B2 * b2) {
+  producer_produceTokens_netReader(tt, 1, b2);
+}
+
+// In the record mode, a datagram or a line may be up to recordSizeMax(b2)
+// bytes long. Its size is peeked first, so that the record reserves only
+// its own span of the sharedBuffer.
+static void producer_produceRecord_netReader (struct B2 * b2) {
+  TokenType* initToken = (TokenType*)b2->producer.tokens2produce.in;
+  unsigned int * sid = (unsigned int *)
+    (initToken->theMessage + sizeof(int) + sizeof(struct NetReader *));
+  struct NetReader * r = (struct NetReader *)b2->producer.source;
+  ssize_t size;
+  RecordType* rt;
+  int source;
+
+  if ((size = netReceive(r, NULL, recordSizeMax(b2), &source, true)) < 0)
+    return;
+  if ((rt = reserveRecord(b2, size)) == NULL) return;
+  netReceive(r, rt->theMessage, size, &rt->source, false); // the one peeked
+  rt->sid = (*sid)++;
+  rt->size = size;
+  rt->theDelay = 0ll;
+  rt->theMessage[size] = '\0';
+  commitRecord(b2, rt);
+}
+
+static void producer_cleanupOnClose_netReader (struct B2 * b2) {
+  struct NetReader * r = (struct NetReader *)b2->producer.source;
+  struct fifo * t;
+
+  while ((t = fifoPeek(&r->sockets))) dropSocket(r, (struct NetSocket *)t);
+  if (r->spareFd != -1) assert(0 == close(r->spareFd));
+  assert(0 == close(r->epollfd));
+  free(r);
+  b2->producer.source = NULL;
+}
+#else
+static void producer_initOnOpen_netReader (struct B2 * b2) {
+}
+
+static void producer_cleanupOnClose_netReader (struct B2 * b2) {
+}
+
+static void
+producer_produceToken_netReader (TokenType* tt, struct B2 * b2) {
+}
+#define producer_produceTokens_netReader 0
+#define producer_openSockets_netReader 0
+#define producer_produceRecord_netReader 0
+#endif
+
+#ifdef __gnu_linux__
+// The udpReader and the udpWriter move up to MMSG_BATCH datagrams per
+// recvmmsg/sendmmsg straight between the socket and the run of slots (or of
+// records). b2->data is 'port\nhost:port': the udpReader binds the port, the
+// udpWriter sends to host:port. An empty datagram ends the transmission.
+#define MMSG_BATCH 64
+
+struct Mmsg {
+  int fd;
+  struct mmsghdr msgs[MMSG_BATCH];
+  struct iovec iov[MMSG_BATCH];
+  char formatted[MMSG_BATCH][128]; // the sid and the delay, when not copying
+};
+
+static void mmsgPrepare (struct Mmsg* g, size_t i, void* m, size_t size) {
+  g->iov[i].iov_base = m;
+  g->iov[i].iov_len = size;
+  memset(&g->msgs[i].msg_hdr, 0, sizeof(g->msgs[i].msg_hdr));
+  g->msgs[i].msg_hdr.msg_iov = &g->iov[i];
+  g->msgs[i].msg_hdr.msg_iovlen = 1;
+}
+
+// The host:port of the udpWriter in b2->data, or NULL.
+static inline const char* udpWriterAddress (struct B2 * b2) {
+  const char* nl = strchr(b2->data, '\n');
+
+  return nl ? nl + 1 : NULL;
+}
+
+// Bind the port of b2->data on the main thread, see B2T_Open.
+static int
+producer_openSockets_udpReader (struct B2 * b2, char* error, size_t errorSize) {
+  char port[sizeof(b2->data)];
+  struct Mmsg * g;
+  int fd;
+
+  strcpy(port, b2->data);
+  port[strcspn(port, "\n")] = '\0';
+  if ((fd = udpFdBnd(port, &b2->udp, error, errorSize)) == -1) return -1;
+  assert(0 == fcntl(fd, F_SETFL, O_NONBLOCK)); // polled with the wakeFd
+  assert((g = malloc(sizeof(struct Mmsg))));
+  g->fd = fd;
+  b2->producer.source = g;
+#ifdef DEBUG_PRINTF
+  printf("producer_openSockets_udpReader port %s\n", port);
+#endif
+  return 0;
+}
+
+static void producer_initOnOpen_udpReader (struct B2 * b2) {
+  TokenType* initToken;
+
+  initOnOpen(b2);
+  initToken = (TokenType*)b2->producer.tokens2produce.in;
+  *(struct Mmsg **)(initToken->theMessage + sizeof(int)) = b2->producer.source;
+}
+
+// Receive up to n datagrams into the messages prepared in g, waiting for the
+// first one unless the b2 is being closed; see netReceive.
+static int mmsgReceive (struct Mmsg* g, unsigned int n, struct B2 * b2) {
+  struct pollfd fds[2] = {
+    { g->fd, POLLIN, 0 }, { b2->producer.wakeFd, POLLIN, 0 }
+  };
+  int m;
+
+  while ((m = recvmmsg(g->fd, g->msgs, n, MSG_DONTWAIT, NULL)) == -1) {
+    assert(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+    if (-1 == poll(fds, 2, -1)) assert(errno == EINTR);
+    if (fds[1].revents) return 0; // B2T_Close
+  }
+  return m;
+}
+
+static size_t
+producer_produceTokens_udpReader (TokenType* slots, size_t n, struct B2 * b2) {
+  TokenType* initToken = (TokenType*)b2->producer.tokens2produce.in;
+  unsigned int * sid = (unsigned int *)
+    (initToken->theMessage + sizeof(int) + sizeof(struct Mmsg *));
+  struct Mmsg * g = (struct Mmsg *)b2->producer.source;
+  size_t i, size;
+  int m;
+
+  if (initToken->tt_this.sid == 0) { // wait until b2 is closed
+    waitForClose(b2);
+    return 0;
+  }
+  if (n > MMSG_BATCH) n = MMSG_BATCH;
+  for (i = 0; i < n; i++)
+    mmsgPrepare(g, i, slots[i].theMessage, sizeof(slots->theMessage) - 1);
+  m = mmsgReceive(g, n, b2);
+  for (i = 0; i < (size_t)m; i++) {
+    size = g->msgs[i].msg_len;
+    slots[i].theMessage[size] = '\0';
+    slots[i].tt_this.sid = (*sid)++;
+    slots[i].theDelay = 0ll;
+    slots[i].source = g->fd;
+    if (size == 0) { // produce eot
+      *((char *)&slots[i].theDelay) = '\004';
+      initToken->tt_this.sid = 0;
+      return i + 1;
+    }
+  }
+  return i;
+}
+
+static void
+producer_produceToken_udpReader (TokenType* tt, struct B2 * b2) {
+  producer_produceTokens_udpReader(tt, 1, b2);
+}
+
+static void producer_cleanupOnClose_udpReader (struct B2 * b2) {
+  struct Mmsg * g = (struct Mmsg *)b2->producer.source;
+
+  assert(0 == close(g->fd));
+  free(g);
+  b2->producer.source = NULL;
+}
+
+// Connect to the host:port of b2->data on the main thread, see B2T_Open.
+static int
+consumer_openSockets_udpWriter (struct B2 * b2, char* error, size_t errorSize) {
+  const char* address = udpWriterAddress(b2);
+  char host[sizeof(b2->data)], * port;
+  struct Mmsg * g;
+  int fd;
+
+  if (address == NULL || (port = strrchr(address, ':')) == NULL) {
+    snprintf(error, errorSize, "expected 'port\\nhost:port', got '%s'",
+        b2->data);
+    return -1;
+  }
+  memcpy(host, address, port - address);
+  host[port++ - address] = '\0';
+  if ((fd = udpFd(host, port, &b2->udp, error, errorSize)) == -1) return -1;
+  assert((g = malloc(sizeof(struct Mmsg))));
+  g->fd = fd;
+  b2->consumer.sink = g;
+#ifdef DEBUG_PRINTF
+  printf("consumer_openSockets_udpWriter %s:%s\n", host, port);
+#endif
+  return 0;
+}
+
+static void consumer_initOnOpen_udpWriter (struct B2 * b2) {
+  TokenType* initToken = waitForInitToken(b2);
+
+  *(int *) initToken->theMessage = ((struct Mmsg *)b2->consumer.sink)->fd;
+}
+
+// Send the n messages prepared in the sink; a datagram the kernel refuses
+// is dropped.
+static void mmsgSend (struct Mmsg* g, unsigned int n) {
+  unsigned int i = 0;
+  int m;
+
+  while (i < n) {
+    if ((m = sendmmsg(g->fd, g->msgs + i, n - i, 0)) > 0) i += m;
+    else if (m == -1 && errno == EINTR) continue;
+    else i++; // e.g. ECONNREFUSED, nobody is listening on host:port
+  }
+}
+
+// Send theMessage of each token of the run when copying, or its sid and
+// delay otherwise. The end-of-transmission token closes the b2 and ends the
+// run.
+static size_t
+consumer_consumeTokens_udpWriter (TokenType* slots, size_t n, struct B2 * b2) {
+  TokenType* initToken = (TokenType*)b2->producer.tokens2produce.in;
+  FILE ** fpp = (FILE **)(initToken->theMessage + sizeof(int));
+  struct Mmsg * g = (struct Mmsg *)b2->consumer.sink;
+  size_t i, m = 0, size;
+  const char * message;
+  char eot = 0;
+
+  if (n > MMSG_BATCH) n = MMSG_BATCH;
+  for (i = 0; i < n && !eot; i++) {
+    eot = *((char *)&slots[i].theDelay); // the end-of-transmission indicator
+    if (*fpp == NULL)
+      mmsgPrepare(g, m, g->formatted[m], sprintf(g->formatted[m],
+            "sid %d, ∆ %lldµs\n", slots[i].tt_this.sid,
+            nowUs() - initToken->theDelay));
+    else if (!eot) {
+      message = tokenMessage(b2, slots + i, &size);
+      mmsgPrepare(g, m, (void*)message, size);
+    }
+    else continue;
+    m++;
+  }
+  mmsgSend(g, m);
+  if (eot) closeOnEot(b2);
+  return i;
+}
+
+static void
+consumer_consumeToken_udpWriter (TokenType* tt, struct B2 * b2) {
+  consumer_consumeTokens_udpWriter(tt, 1, b2);
+}
+
+static size_t
+consumer_consumeRecords_udpWriter (RecordType* r, size_t n, struct B2 * b2) {
+  TokenType* initToken = (TokenType*)b2->producer.tokens2produce.in;
+  FILE ** fpp = (FILE **)(initToken->theMessage + sizeof(int));
+  struct Mmsg * g = (struct Mmsg *)b2->consumer.sink;
+  size_t i, m = 0;
+  char eot = 0;
+
+  if (n > MMSG_BATCH) n = MMSG_BATCH;
+  for (i = 0; i < n && !eot; i++, r = nextRecord(r)) {
+    eot = *((char *)&r->theDelay); // the end-of-transmission indicator
+    if (*fpp == NULL)
+      mmsgPrepare(g, m, g->formatted[m], sprintf(g->formatted[m],
+            "sid %u, ∆ %lldµs\n", r->sid, nowUs() - initToken->theDelay));
+    else if (r->size) mmsgPrepare(g, m, r->theMessage, r->size);
+    else continue;
+    m++;
+  }
+  mmsgSend(g, m);
+  if (eot) closeOnEot(b2);
+  return i;
+}
+
+static void
+consumer_consumeRecord_udpWriter (RecordType* r, struct B2 * b2) {
+  consumer_consumeRecords_udpWriter(r, 1, b2);
+}
+
+static void consumer_cleanupOnClose_udpWriter (struct B2 * b2) {
+  struct Mmsg * g = (struct Mmsg *)b2->consumer.sink;
+
+  assert(0 == close(g->fd));
+  free(g);
+  b2->consumer.sink = NULL;
+  reportWritten(b2);
+}
+#else
+static void producer_initOnOpen_udpReader (struct B2 * b2) {
+}
+
+static void producer_cleanupOnClose_udpReader (struct B2 * b2) {
+}
+
+static void
+producer_produceToken_udpReader (TokenType* tt, struct B2 * b2) {
+}
+#define producer_produceTokens_udpReader 0
+#define producer_openSockets_udpReader 0
+
+static void consumer_initOnOpen_udpWriter (struct B2 * b2) {
+}
+
+static void consumer_cleanupOnClose_udpWriter (struct B2 * b2) {
+}
+
+static void
+consumer_consumeToken_udpWriter (TokenType* tt, struct B2 * b2) {
+}
+#define consumer_consumeTokens_udpWriter 0
+#define consumer_openSockets_udpWriter 0
+#define consumer_consumeRecord_udpWriter 0
+#define consumer_consumeRecords_udpWriter 0
+#endif
+
+// The producer thread of the direct sender copies to the sharedBuffer the
+// tokens the main thread could not fit there (see sendToken and sendBytes).
+static void producer_produce_directSender (struct B2 * b2) {
+  struct mpsc* q = &b2->producer.tokens2produce;
+  struct fifo* t;
+  unsigned int seen;
+  bool full;
+
+  uv_mutex_lock(&b2->tokenProducingMutex);
+  if (mpscEmpty(q)) waitForPush(b2);
+  while ((t = mpscPeek(q)) && directProduce(b2, t)) {
+    freeTokenNode(b2, mpscPop(q));
+    checkDrain(b2);
+  }
+  full = t != NULL; // else empty, or a push is linking its node
+  seen = b2->consumeCountCached;
+  uv_mutex_unlock(&b2->tokenProducingMutex);
+  if (full) waitForRelease(b2, seen);
+}
+
 void (*producer_initOnOpen[]) (struct B2 *) = {
   producer_initOnOpen_default,
   producer_initOnOpen_sidSetter,
   producer_initOnOpen_bioFileReader,
-  producer_initOnOpen_epollFileReader
+  producer_initOnOpen_epollFileReader,
+  producer_initOnOpen_default,
+  producer_initOnOpen_mmapFileReader,
+  producer_initOnOpen_uringFileReader,
+  producer_initOnOpen_netReader,
+  producer_initOnOpen_udpReader
 };
 void (*producer_cleanupOnClose[]) (struct B2 *) = {
   producer_cleanupOnClose_default,
   producer_cleanupOnClose_sidSetter,
   producer_cleanupOnClose_bioFileReader,
-  producer_cleanupOnClose_epollFileReader
+  producer_cleanupOnClose_epollFileReader,
+  producer_cleanupOnClose_default,
+  producer_cleanupOnClose_default, // Finalize unmaps the file
+  producer_cleanupOnClose_uringFileReader,
+  producer_cleanupOnClose_netReader,
+  producer_cleanupOnClose_udpReader
 };
 void (*producer_produceToken[]) (TokenType* tt, struct B2 * b2) = {
   producer_produceToken_default,
   producer_produceToken_sidSetter,
   producer_produceToken_bioFileReader,
-  producer_produceToken_epollFileReader
+  producer_produceToken_epollFileReader,
+  0,
+  producer_produceToken_mmapFileReader,
+  producer_produceToken_uringFileReader,
+  producer_produceToken_netReader,
+  producer_produceToken_udpReader
+};
+size_t (*producer_produceTokens[]) (TokenType* slots, size_t n, struct B2 * b2) = {
+  0,
+  producer_produceTokens_sidSetter,
+  producer_produceTokens_bioFileReader,
+  produceLines, // epollFileReader
+  0,
+  producer_produceTokens_mmapFileReader,
+  produceLines, // uringFileReader
+  producer_produceTokens_netReader,
+  producer_produceTokens_udpReader
+};
+void (*producer_produce[]) (struct B2 * b2) = {
+  0,
+  0,
+  0,
+  0,
+  producer_produce_directSender,
+  0,
+  0,
+  0,
+  0
+};
+int (*producer_openSockets[]) (struct B2 *, char* error, size_t errorSize) = {
+  0,
+  0,
+  producer_openSockets_file,
+  producer_openSockets_file,
+  0,
+  producer_openSockets_mmapFileReader,
+  producer_openSockets_file,
+  producer_openSockets_netReader,
+  producer_openSockets_udpReader
+};
+bool producer_polls[] = { // its fds, with the wakeFd of the b2
+  false,
+  false,
+  false,
+  true,
+  false,
+  false,
+  false,
+  true,
+  true
+};
+void (*producer_produceRecord[]) (struct B2 * b2) = {
+  producer_produceRecord_default,
+  producer_produceRecord_sidSetter,
+  producer_produceRecord_bioFileReader,
+  0,
+  producer_produce_directSender,
+  0,
+  0,
+  producer_produceRecord_netReader,
+  0
 };
 void (*consumer_initOnOpen[]) (struct B2 *) = {
   consumer_initOnOpen_default,
   consumer_initOnOpen_bioFileWriter,
-  consumer_initOnOpen_epollFileWriter
+  consumer_initOnOpen_epollFileWriter,
+  consumer_initOnOpen_uringFileWriter,
+  consumer_initOnOpen_udpWriter
 };
 void (*consumer_cleanupOnClose[]) (struct B2 *) = {
   consumer_cleanupOnClose_default,
   consumer_cleanupOnClose_bioFileWriter,
-  consumer_cleanupOnClose_epollFileWriter
+  consumer_cleanupOnClose_epollFileWriter,
+  consumer_cleanupOnClose_uringFileWriter,
+  consumer_cleanupOnClose_udpWriter
+};
+int (*consumer_openSockets[]) (struct B2 *, char* error, size_t errorSize) = {
+  0,
+  0,
+  consumer_openSockets_epollFileWriter,
+  0,
+  consumer_openSockets_udpWriter
+};
+bool consumer_polls[] = { // its fds, with the wakeFd of the b2
+  false,
+  false,
+  true,
+  false,
+  false
 };
 void (*consumer_consumeToken[]) (TokenType* tt, struct B2 * b2) = {
   consumer_consumeToken_default,
   consumer_consumeToken_bioFileWriter,
-  consumer_consumeToken_epollFileWriter
+  consumer_consumeToken_epollFileWriter,
+  consumer_consumeToken_uringFileWriter,
+  consumer_consumeToken_udpWriter
+};
+size_t (*consumer_consumeTokens[]) (TokenType* slots, size_t n, struct B2 * b2) = {
+  0,
+  consumer_consumeTokens_bioFileWriter,
+  consumer_consumeTokens_epollFileWriter,
+  consumer_consumeTokens_uringFileWriter,
+  consumer_consumeTokens_udpWriter
+};
+void (*consumer_consumeRecord[]) (RecordType* r, struct B2 * b2) = {
+  consumer_consumeRecord_default,
+  consumer_consumeRecord_bioFileWriter,
+  consumer_consumeRecord_epollFileWriter,
+  consumer_consumeRecord_uringFileWriter,
+  consumer_consumeRecord_udpWriter
+};
+size_t (*consumer_consumeRecords[]) (RecordType* r, size_t n, struct B2 * b2) = {
+  0,
+  0,
+  consumer_consumeRecords_epollFileWriter,
+  consumer_consumeRecords_uringFileWriter,
+  consumer_consumeRecords_udpWriter
 };
 
 static inline struct B2 *
 newB2native (napi_env env, size_t argc, napi_value* argv, ModuleData* md) {
-  assert(argc == 4); 
+  assert(argc >= 4); 
+  napi_value options = argc > 4 ? argv[4] : NULL;
+  bool records = optionBool(env, options, "records");
+  uint32_t window = optionUint32(env, options, "window", 1);
+  uint32_t flushThreshold = optionUint32(env, options, "flushThreshold", 65536);
+  uint32_t spinBudget = optionUint32(env, options, "spinBudget", 1000);
+  bool loop = optionBool(env, options, "loop");
+  uint32_t poolSize = optionUint32(env, options, "poolSize", 256);
+  uint32_t poolGrowth = optionUint32(env, options, "poolGrowth", poolSize);
+  uint32_t highWaterMark = optionUint32(env, options, "highWaterMark", 128);
+  uint32_t lowWaterMark =
+    optionUint32(env, options, "lowWaterMark", highWaterMark / 2);
+  const char* waits[] = { "block", "spin", "yield", "spinPark", NULL };
+  char waitName[16] = "block";
+  enum WaitStrategy wait;
+  struct UdpOptions udp = {
+    optionBool(env, options, "ipv6"),
+    optionBool(env, options, "reusePort"),
+    optionUint32(env, options, "rcvbuf", 0),
+    optionUint32(env, options, "sndbuf", 0),
+    optionUint32(env, options, "busyPoll", 0)
+  };
+  struct ThreadOptions producerThread = {
+    { 0 }, optionUint32(env, options, "producerPriority", 0), ""
+  }, consumerThread = {
+    { 0 }, optionUint32(env, options, "consumerPriority", 0), ""
+  };
+  if (!optionCpus(env, options, "producerCpus", &producerThread) ||
+      !optionCpus(env, options, "consumerCpus", &consumerThread)) {
+    napi_throw_range_error(env, NULL, "CPU number out of range");
+    return NULL;
+  }
+  optionString(env, options, "producerName", producerThread.name,
+      sizeof(producerThread.name));
+  optionString(env, options, "consumerName", consumerThread.name,
+      sizeof(consumerThread.name));
+  optionString(env, options, "wait", waitName, sizeof(waitName));
+  for (wait = WAIT_BLOCK; waits[wait] && strcmp(waits[wait], waitName); wait++);
+  if (waits[wait] == NULL) {
+    napi_throw_range_error(env, NULL, "unknown wait strategy");
+    return NULL;
+  }
+  if (lowWaterMark > highWaterMark) {
+    napi_throw_range_error(env, NULL,
+        "lowWaterMark is greater than highWaterMark");
+    return NULL;
+  }
   uint32_t producerId = uint32(env, *argv++);
   uint32_t consumerId = uint32(env, *argv++);
+#ifdef __gnu_linux__
+  if (loop && consumerId != 0) {
+    napi_throw_range_error(env, NULL,
+        "the loop option needs the default consumer");
+    return NULL;
+  }
+#else
+  if (loop) {
+    napi_throw_error(env, NULL, "the loop consumer needs eventfd");
+    return NULL;
+  }
+#endif
   char data[256];
   assert(napi_ok == napi_get_value_string_utf8(env, *argv++, data, 256, &argc));
   assert(argc < 256);
-  size_t sharedBuffer_size = uint32(env, *argv), i0 = sizeof(data) - 1;
+  size_t sharedBuffer_size = uint32(env, *argv), i0 = sizeof(data) - 1, i;
+  if (records && !(producer_produceRecord[producerId] &&
+        consumer_consumeRecord[consumerId])) {
+    napi_throw_range_error(env, NULL,
+        "the records option needs a producer and a consumer of records");
+    return NULL;
+  }
+
+  // The record ring masks its byte counts, see reserveRecord.
+  if (records && (sharedBuffer_size & (sharedBuffer_size - 1))) {
+    napi_throw_range_error(env, NULL,
+        "the records option needs a power of two bufsize");
+    return NULL;
+  }
   size_t b2size = sizeof(struct B2) + sizeof(TokenType) * sharedBuffer_size;
-  struct B2 * b2 = (struct B2 *)memset(malloc(b2size), 0, b2size);
+  struct B2 * b2;
+  assert(0 == posix_memalign((void**)&b2, B2_CACHELINE, b2size));
+  memset(b2, 0, b2size);
   strncpy(b2->data, data, i0);
   b2->data[i0] = '\0';
   b2->sharedBuffer_size = sharedBuffer_size;
+  poolInit(&b2->producer.pool, poolSize, poolGrowth);
+  b2->producer.highWaterMark = highWaterMark;
+  b2->producer.lowWaterMark = lowWaterMark;
+  b2->udp = udp;
+  b2->wait = wait;
+  b2->spinBudget = spinBudget;
   b2->producer.initOnOpen = producer_initOnOpen[producerId];
   b2->producer.cleanupOnClose = producer_cleanupOnClose[producerId];
   b2->producer.produceToken = producer_produceToken[producerId];
+  b2->producer.produceTokens = producer_produceTokens[producerId];
+  b2->producer.produce = producer_produce[producerId];
+  b2->producer.openSockets = producer_openSockets[producerId];
+#ifdef __gnu_linux__
+  if (producer_polls[producerId])
+    assert(-1 != (b2->producer.wakeFd =
+          eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)));
+#endif
   b2->consumer.initOnOpen = consumer_initOnOpen[consumerId];
   b2->consumer.cleanupOnClose = consumer_cleanupOnClose[consumerId];
   b2->consumer.consumeToken = consumer_consumeToken[consumerId];
+  b2->consumer.consumeTokens = consumer_consumeTokens[consumerId];
+  b2->consumer.openSockets = consumer_openSockets[consumerId];
+#ifdef __gnu_linux__
+  if (consumer_polls[consumerId])
+    assert(-1 != (b2->consumer.wakeFd =
+          eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)));
+#endif
+  b2->consumer.window = window ? window : 1;
+  b2->consumer.loop = loop;
+  b2->consumer.flushThreshold = flushThreshold;
+  if ((b2->records = records)) { // a byte ring, 128 bytes per TokenType
+    b2->sharedBuffer_size *= sizeof(((TokenType *)0)->theMessage);
+    b2->producer.produce = producer_produceRecord[producerId];
+    b2->consumer.consumeRecord = consumer_consumeRecord[consumerId];
+    b2->consumer.consumeRecords = consumer_consumeRecords[consumerId];
+  }
+  else { // one reusable TokenType object per slot, see wrapToken
+    b2->consumer.wrappers = malloc(sizeof(napi_ref) * sharedBuffer_size);
+    b2->consumer.slots = malloc(sizeof(struct TokenSlot) * sharedBuffer_size);
+    assert(b2->consumer.wrappers && b2->consumer.slots);
+    for (i = 0; i < sharedBuffer_size; i++) {
+      b2->consumer.slots[i].token = &b2->sharedBuffer[i];
+      b2->consumer.slots[i].b2 = b2;
+      assert(napi_ok == napi_create_reference(env, newInstance(env,
+              md->tt_constructor, &b2->consumer.slots[i], 0, 0), 1,
+            &b2->consumer.wrappers[i]));
+    }
+  }
+  b2->producer.direct = b2->producer.produce == producer_produce_directSender;
+  b2->producer.refs =
+    b2->producer.produceTokens == producer_produceTokens_mmapFileReader;
   b2->md = md;
   fifoIn(&md->b2instances, &b2->b2t_this);
+  b2->producer.thread = producerThread;
+  b2->consumer.thread = consumerThread;
+  if (producerThread.name[0] == '\0')
+    snprintf(b2->producer.thread.name, sizeof(producerThread.name), "b2p%u",
+        b2->b2t_this.sid);
+  if (consumerThread.name[0] == '\0')
+    snprintf(b2->consumer.thread.name, sizeof(consumerThread.name), "b2c%u",
+        b2->b2t_this.sid);
   assert(uv_mutex_init(&b2->tokenProducedMutex) == 0);
   assert(uv_mutex_init(&b2->tokenConsumedMutex) == 0);
   assert(uv_mutex_init(&b2->tokenProducingMutex) == 0);
@@ -929,24 +3501,57 @@ newB2native (napi_env env, size_t argc, napi_value* argv, ModuleData* md) {
 // start and stop the producer/consumer pair of threads, and to send and receive
 // messages from the producer to the consumer.
 napi_value NewB2 (napi_env env, napi_callback_info info) {
-  size_t argc = 4;
-  napi_value argv[4], this;
+  size_t argc = 5;
+  napi_value argv[5], this;
   ModuleData* md;
   struct B2 *b2;
 
   assert(napi_ok == napi_get_cb_info(env, info, &argc, argv, 0, (void*)&md));
-  b2 = newB2native(env, argc, argv, md);
-  fifoInit(&b2->producer.tokens2produce);
+  if ((b2 = newB2native(env, argc, argv, md)) == NULL) return NULL;
+  mpscInit(&b2->producer.tokens2produce);
   this = newInstance(env, md->b2t_constructor, b2, 0, 0);
   return this;
 }
 
+// The byte offsets and sizes JavaScript needs to read the consumer.buffer and
+// the consumer.indices in place.
+static inline napi_value Layout (napi_env env) {
+  struct { const char* name; size_t value; } *p, fields[] = {
+    { "tokenSize", sizeof(TokenType) },
+    { "tokenSid", offsetof(TokenType, tt_this.sid) },
+    { "tokenMessage", offsetof(TokenType, theMessage) },
+    { "tokenMessageSize", sizeof(((TokenType *)0)->theMessage) },
+    { "tokenDelay", offsetof(TokenType, theDelay) },
+    { "tokenSource", offsetof(TokenType, source) },
+    { "tokenLength", offsetof(TokenType, length) },
+    { "recordSid", offsetof(RecordType, sid) },
+    { "recordSize", offsetof(RecordType, size) },
+    { "recordDelay", offsetof(RecordType, theDelay) },
+    { "recordSource", offsetof(RecordType, source) },
+    { "recordMessage", offsetof(RecordType, theMessage) },
+    { "recordHeader", sizeof(RecordType) }, // see recordSpan
+    { "recordAlign", RECORD_ALIGN },
+    { "produceCount", 0 }, // indexes in consumer.indices
+    { "consumeCount", 1 },
+    { NULL, 0 }
+  };
+  napi_value result, value;
+
+  assert(napi_ok == napi_create_object(env, &result));
+  for (p = fields; p->name; p++) {
+    assert(napi_ok == napi_create_uint32(env, p->value, &value));
+    assert(napi_ok == napi_set_named_property(env, result, p->name, value));
+  }
+  return result;
+}
+
 static inline napi_value Bindings (
     napi_env env, napi_value exports, ModuleData* md) {
   napi_property_descriptor p[] = {
-    { "newB2", 0, NewB2, 0, 0, 0, napi_default, md }
+    { "newB2", 0, NewB2, 0, 0, 0, napi_default, md },
+    { "layout", 0, 0, 0, 0, Layout(env), napi_enumerable, 0 }
   };
-  assert(napi_ok == napi_define_properties(env, exports, 1, p));
+  assert(napi_ok == napi_define_properties(env, exports, 2, p));
   return exports;
 }
 
@@ -3,61 +3,133 @@
 
 #define _GNU_SOURCE
 
+#include <errno.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
 #include <netdb.h>
 #include <string.h>
 #include <unistd.h>
 
-static inline int udpFdBnd (const char *port, int options) {
-  struct addrinfo hints, *result, *a;
-  memset(&hints, 0, sizeof(struct addrinfo));
-  hints.ai_family = AF_INET; // or AF_INET6 or AF_UNSPEC
-  hints.ai_socktype = SOCK_DGRAM;
-  hints.ai_flags = AI_PASSIVE;
-
-  int rc, fd;
-  if ((rc = getaddrinfo(NULL, port, &hints, &result))) {
-    fprintf(stderr, "getaddrinfo rc=%d, %s\n", rc, gai_strerror(rc));
-    exit(EXIT_FAILURE);
-  };
-  for (a = result; a != NULL; a = a->ai_next) {
-    fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
-    if (fd < 0) continue;
-    if (bind(fd, a->ai_addr, a->ai_addrlen) == 0) break;
-    close(fd);
-  }
-  freeaddrinfo(result);
-  if (a == NULL) {
-    fprintf(stderr, "Could not bind\n"); exit(EXIT_FAILURE);
-  }
-  return fd;
+#ifndef SOCK_CLOEXEC
+#define SOCK_CLOEXEC 0
+#endif
+
+// The options of the sockets udpFdBnd, tcpFdLsn and udpFd create; a zeroed
+// struct UdpOptions (or NULL) keeps the defaults of the system.
+struct UdpOptions {
+  bool ipv6; // AF_INET6 dual-stack rather than AF_INET
+  bool reusePort; // SO_REUSEPORT
+  int rcvbuf, sndbuf; // SO_RCVBUF, SO_SNDBUF, in bytes
+  int busyPoll; // SO_BUSY_POLL, in µs
+};
+
+// On failure, the socket functions return -1 and describe the error in the
+// errorSize bytes of error.
+static inline int udpError (char* error, size_t errorSize, const char* what,
+    const char* port, const char* reason) {
+  snprintf(error, errorSize, "%s %s: %s", what, port, reason);
+  return -1;
 }
 
-static inline int udpFd (const char *host, const char *port, int options) {
+// Set a buffer size, forcing it past the rmem_max (wmem_max) limit when
+// permitted.
+static inline int udpBufferSize (int fd, int option, int size) {
+#ifdef SO_RCVBUFFORCE
+  int force = option == SO_RCVBUF ? SO_RCVBUFFORCE : SO_SNDBUFFORCE;
+
+  if (setsockopt(fd, SOL_SOCKET, force, &size, sizeof(size)) == 0) return 0;
+#endif
+  return setsockopt(fd, SOL_SOCKET, option, &size, sizeof(size));
+}
+
+// Apply the options o to the socket fd; returns the name of the option that
+// failed, or NULL.
+static inline const char* udpSetOptions (int fd, int family,
+    const struct UdpOptions* o) {
+  int on = 1, off = 0;
+
+  if (family == AF_INET6 &&
+      setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)))
+    return "IPV6_V6ONLY";
+  if (o == NULL) return NULL;
+  if (o->reusePort &&
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)))
+    return "SO_REUSEPORT";
+  if (o->rcvbuf && udpBufferSize(fd, SO_RCVBUF, o->rcvbuf))
+    return "SO_RCVBUF";
+  if (o->sndbuf && udpBufferSize(fd, SO_SNDBUF, o->sndbuf))
+    return "SO_SNDBUF";
+#ifdef SO_BUSY_POLL
+  if (o->busyPoll && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL,
+        &o->busyPoll, sizeof(o->busyPoll)))
+    return "SO_BUSY_POLL";
+#endif
+  return NULL;
+}
+
+// Create a socket of the type for each address of host:port (the wildcard
+// address when host is NULL), apply the options o, and bind (connect) it;
+// listen on a SOCK_STREAM one. Returns the first socket that succeeds.
+static inline int udpSocket (const char *host, const char *port, int type,
+    const struct UdpOptions* o, char* error, size_t errorSize) {
+  const char* what = host ? "connect" : type == SOCK_STREAM ? "listen" : "bind";
+  const char* failed = NULL;
   struct addrinfo hints, *result, *a;
+  int rc, fd = -1, on = 1, err = 0;
+
   memset(&hints, 0, sizeof(struct addrinfo));
-  hints.ai_family = AF_INET; // or AF_INET6 or AF_UNSPEC
-  hints.ai_socktype = SOCK_DGRAM;
-
-  int rc, fd;
-  if ((rc = getaddrinfo(host, port, &hints, &result))) {
-    fprintf(stderr, "getaddrinfo rc=%d, %s\n", rc, gai_strerror(rc));
-    exit(EXIT_FAILURE);
-  };
+  hints.ai_family = o && o->ipv6 ? (host ? AF_UNSPEC : AF_INET6) : AF_INET;
+  hints.ai_socktype = type;
+  hints.ai_flags = host ? 0 : AI_PASSIVE;
+  if ((rc = getaddrinfo(host, port, &hints, &result)))
+    return udpError(error, errorSize, what, port, gai_strerror(rc));
   for (a = result; a != NULL; a = a->ai_next) {
-    fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
-    if (fd < 0) continue;
-    if (connect(fd, a->ai_addr, a->ai_addrlen) == 0) break;
+    failed = NULL; // the error is that of the last address tried
+    err = errno = 0;
+    if ((fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC,
+            a->ai_protocol)) < 0) {
+      err = errno;
+      continue;
+    }
+    if (type == SOCK_STREAM)
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if ((failed = udpSetOptions(fd, a->ai_family, o)) == NULL &&
+        (host ? connect(fd, a->ai_addr, a->ai_addrlen) :
+         bind(fd, a->ai_addr, a->ai_addrlen)) == 0 &&
+        (type != SOCK_STREAM || listen(fd, SOMAXCONN) == 0)) break;
+    err = errno;
     close(fd);
+    fd = -1;
   }
   freeaddrinfo(result);
-  if (a == NULL) {
-    fprintf(stderr, "Could not connect\n"); exit(EXIT_FAILURE);
+  if (fd == -1 && failed) {
+    snprintf(error, errorSize, "%s %s: %s: %s", what, port, failed,
+        strerror(err));
+    return -1;
   }
+  if (fd == -1)
+    return udpError(error, errorSize, what, port,
+        err ? strerror(err) : "no address");
   return fd;
 }
 
+static inline int udpFdBnd (const char *port, const struct UdpOptions* o,
+    char* error, size_t errorSize) {
+  return udpSocket(NULL, port, SOCK_DGRAM, o, error, errorSize);
+}
+
+static inline int tcpFdLsn (const char *port, const struct UdpOptions* o,
+    char* error, size_t errorSize) {
+  return udpSocket(NULL, port, SOCK_STREAM, o, error, errorSize);
+}
+
+static inline int udpFd (const char *host, const char *port,
+    const struct UdpOptions* o, char* error, size_t errorSize) {
+  return udpSocket(host, port, SOCK_DGRAM, o, error, errorSize);
+}
+
 #endif // UDP_H
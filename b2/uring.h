@@ -0,0 +1,187 @@
+#ifndef URING_H
+#define URING_H
+
+#ifdef __gnu_linux__
+#include <assert.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// A minimal io_uring of URING_DEPTH registered chunk buffers, one read or
+// write per chunk in flight. When the kernel does not provide io_uring, fd
+// is -1 and uringQueue does the I/O synchronously with pread/pwrite.
+#define URING_DEPTH 8
+#define URING_CHUNK 65536
+
+struct Uring {
+  int fd;
+  unsigned *sqHead, *sqTail, *sqMask, *sqArray, *cqHead, *cqTail, *cqMask;
+  struct io_uring_sqe* sqes;
+  struct io_uring_cqe* cqes;
+  void *sq, *cq;
+  size_t sqSize, cqSize, sqesSize;
+  unsigned queued, pending; // not yet submitted, submitted not yet completed
+  int res[URING_DEPTH]; // of the completed chunk i
+  bool done[URING_DEPTH]; // chunk i is not in flight
+  char* buffers; // URING_DEPTH chunks of URING_CHUNK bytes
+};
+
+static inline char* uringChunk (struct Uring* u, unsigned i) {
+  return u->buffers + (size_t)i * URING_CHUNK;
+}
+
+static inline int uringEnter (struct Uring* u, unsigned toSubmit,
+    unsigned minComplete, unsigned flags) {
+  return syscall(__NR_io_uring_enter, u->fd, toSubmit, minComplete, flags,
+      NULL, 0);
+}
+
+static inline void uringUnmap (struct Uring* u) {
+  munmap(u->sqes, u->sqesSize);
+  if (u->cq != u->sq) munmap(u->cq, u->cqSize);
+  munmap(u->sq, u->sqSize);
+  close(u->fd);
+}
+
+static inline void uringInit (struct Uring* u) {
+  struct io_uring_params p;
+  struct iovec iov[URING_DEPTH];
+  unsigned i;
+
+  memset(u, 0, sizeof(*u));
+  for (i = 0; i < URING_DEPTH; i++) u->done[i] = true;
+  assert(0 == posix_memalign((void**)&u->buffers, 4096,
+        URING_DEPTH * URING_CHUNK));
+  memset(&p, 0, sizeof(p));
+  if ((u->fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p)) == -1) {
+    perror("uringInit io_uring_setup, falling back to pread/pwrite");
+    return;
+  }
+  u->sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    u->sqSize = u->cqSize = u->sqSize > u->cqSize ? u->sqSize : u->cqSize;
+  u->sq = mmap(0, u->sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      u->fd, IORING_OFF_SQ_RING);
+  assert(MAP_FAILED != u->sq);
+  u->cq = p.features & IORING_FEAT_SINGLE_MMAP ? u->sq :
+    mmap(0, u->cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        u->fd, IORING_OFF_CQ_RING);
+  assert(MAP_FAILED != u->cq);
+  u->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = mmap(0, u->sqesSize, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  assert(MAP_FAILED != u->sqes);
+  u->sqHead = (unsigned*)((char*)u->sq + p.sq_off.head);
+  u->sqTail = (unsigned*)((char*)u->sq + p.sq_off.tail);
+  u->sqMask = (unsigned*)((char*)u->sq + p.sq_off.ring_mask);
+  u->sqArray = (unsigned*)((char*)u->sq + p.sq_off.array);
+  u->cqHead = (unsigned*)((char*)u->cq + p.cq_off.head);
+  u->cqTail = (unsigned*)((char*)u->cq + p.cq_off.tail);
+  u->cqMask = (unsigned*)((char*)u->cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe*)((char*)u->cq + p.cq_off.cqes);
+
+  // Register the chunk buffers, so that the kernel does not map them per I/O;
+  // this fails with ENOMEM past RLIMIT_MEMLOCK before Linux 5.12.
+  for (i = 0; i < URING_DEPTH; i++) {
+    iov[i].iov_base = uringChunk(u, i);
+    iov[i].iov_len = URING_CHUNK;
+  }
+  if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS,
+        iov, URING_DEPTH)) {
+    perror("uringInit IORING_REGISTER_BUFFERS, falling back to pread/pwrite");
+    uringUnmap(u);
+    u->fd = -1;
+  }
+}
+
+// Queue the read (IORING_OP_READ_FIXED) or the write (IORING_OP_WRITE_FIXED)
+// of size bytes of chunk i, from byte at of its buffer, at offset of the file
+// fd; uringSubmit submits the queued ones at once.
+static inline void uringQueueAt (struct Uring* u, int op, int fd, unsigned i,
+    size_t at, size_t size, off_t offset) {
+  struct io_uring_sqe* sqe;
+  unsigned tail;
+
+  assert(u->done[i]);
+  u->done[i] = false;
+  if (u->fd == -1) {
+    u->res[i] = op == IORING_OP_READ_FIXED ?
+      pread(fd, uringChunk(u, i) + at, size, offset) :
+      pwrite(fd, uringChunk(u, i) + at, size, offset);
+    if (u->res[i] == -1) u->res[i] = -errno; // like the cqe res
+    u->done[i] = true;
+    return;
+  }
+  tail = *u->sqTail;
+  sqe = &u->sqes[tail & *u->sqMask];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = op;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long)(uringChunk(u, i) + at);
+  sqe->len = size;
+  sqe->off = offset;
+  sqe->buf_index = i;
+  sqe->user_data = i;
+  u->sqArray[tail & *u->sqMask] = tail & *u->sqMask;
+  __atomic_store_n(u->sqTail, tail + 1, __ATOMIC_RELEASE);
+  u->queued++;
+}
+
+static inline void uringQueue (struct Uring* u, int op, int fd, unsigned i,
+    size_t size, off_t offset) {
+  uringQueueAt(u, op, fd, i, 0, size, offset);
+}
+
+static inline void uringSubmit (struct Uring* u) {
+  int n;
+
+  while (u->queued) {
+    if ((n = uringEnter(u, u->queued, 0, 0)) == -1) {
+      assert(errno == EINTR || errno == EAGAIN || errno == EBUSY);
+      continue;
+    }
+    u->queued -= n;
+    u->pending += n;
+  }
+}
+
+static inline void uringReap (struct Uring* u) {
+  unsigned head = *u->cqHead;
+  struct io_uring_cqe* cqe;
+
+  while (head != __atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE)) {
+    cqe = &u->cqes[head++ & *u->cqMask];
+    u->res[cqe->user_data] = cqe->res;
+    u->done[cqe->user_data] = true;
+    u->pending--;
+  }
+  __atomic_store_n(u->cqHead, head, __ATOMIC_RELEASE);
+}
+
+// Wait for chunk i to complete; its result is then u->res[i].
+static inline void uringWait (struct Uring* u, unsigned i) {
+  if (u->fd == -1) return; // done by uringQueue
+  uringSubmit(u);
+  for (uringReap(u); !u->done[i]; uringReap(u))
+    if (uringEnter(u, 0, 1, IORING_ENTER_GETEVENTS) == -1)
+      assert(errno == EINTR || errno == EAGAIN || errno == EBUSY);
+}
+
+static inline void uringExit (struct Uring* u) {
+  unsigned i;
+
+  for (i = 0; i < URING_DEPTH; i++) uringWait(u, i);
+  if (u->fd != -1) uringUnmap(u);
+  free(u->buffers);
+}
+#endif // __gnu_linux__
+
+#endif // URING_H
@@ -1,6 +1,7 @@
 'use strict'
 
 const B2 = require('bindings')('b2')
+const stream = require('stream')
 var start = Date.now()
 
 /**
@@ -21,6 +22,43 @@ class B3 {
    * @param {utf8} r2lData - data string to use in r2l b2 instance
    * @param {bool} noDefaultListeners - the caller will provide all the listeners
    * @param {bool} noSelfTest - the caller will be sending all the messages
+   * @param {object} l2rOptions - options of the l2r b2 instance:
+   *   records - variable-length tokens packed into the shared buffer
+   *   window - the default consumer delivers up to window tokens to the
+   *     'token' listener before the first of them is done with (1)
+   *   flushThreshold - the bioFileWriter writes its output in chunks of
+   *     this many bytes, 0 writes each message through (65536)
+   *   rcvbuf, sndbuf - the socket buffer sizes of the network producers and
+   *     consumers, in bytes (the system defaults)
+   *   reusePort, busyPoll - SO_REUSEPORT and the SO_BUSY_POLL µs of their
+   *     sockets (off)
+   *   ipv6 - their sockets are dual-stack IPv6 ones (false)
+   *   open() throws if the sockets cannot be bound or connected
+   *   producerCpus, consumerCpus - the CPU number, or the array of them,
+   *     the thread is pinned to (any CPU)
+   *   producerPriority, consumerPriority - the SCHED_FIFO priority of the
+   *     thread (0, the default policy)
+   *   producerName, consumerName - the name of the thread, up to 15 bytes
+   *     ('b2p' and 'b2c' followed by the sid)
+   *   wait - how the threads wait on a full or an empty shared buffer:
+   *     'block' on a condvar, 'spin', spin and then 'yield' the CPU, or
+   *     spin and then block, 'spinPark' ('block')
+   *   spinBudget - the spins before 'yield' and 'spinPark' (1000)
+   *   poolSize - the token nodes queued by send() while the shared buffer
+   *     is full come from a pool of this many, allocated up front (256)
+   *   poolGrowth - the nodes added each time the pool runs out, at most 255
+   *     times; 0 keeps the pool fixed. send() throws a RangeError when the
+   *     pool cannot grow (poolSize)
+   *   highWaterMark - send() and sendBuffer() return false once this many
+   *     tokens are queued for the producer thread (128); the producer then
+   *     emits 'drain' when at most lowWaterMark of them are left
+   *     (highWaterMark / 2), see producer.on('drain', listener)
+   *   loop - the default consumer has no thread: its 'run' listener is
+   *     called on the event loop, polling an eventfd the producer signals
+   *     when the shared buffer is no longer empty (false); or, with a
+   *     'readable' listener, consumer.pull() gets the tokens available;
+   *     such a consumer is an async iterable of the batches of tokens
+   * @param {object} r2lOptions - options of the r2l b2 instance
    */
   constructor (
     l2rProducer = 0, // B3.defaults
@@ -32,7 +70,9 @@ class B3 {
     l2rData = '',
     r2lData = '',
     noDefaultListeners = false,
-    noSelfTest = false
+    noSelfTest = false,
+    l2rOptions = {},
+    r2lOptions = {}
   ) {
     r2lBufsize = !r2lBufsize ? l2rBufsize : r2lBufsize
     this.noDefaultListeners =
@@ -42,12 +82,18 @@ class B3 {
       l2rProducer || l2rConsumer || r2lProducer || r2lConsumer ? true
         : noSelfTest
 
-    this._l2r = B2.newB2(l2rProducer, l2rConsumer, l2rData, l2rBufsize)
-    this._r2l = B2.newB2(r2lProducer, r2lConsumer, r2lData, r2lBufsize)
+    this._l2r = B2.newB2(l2rProducer, l2rConsumer, l2rData, l2rBufsize,
+      l2rOptions)
+    this._r2l = B2.newB2(r2lProducer, r2lConsumer, r2lData, r2lBufsize,
+      r2lOptions)
     this.l2rProducer = this._l2r.producer
     this.r2lProducer = this._r2l.producer
     this.l2rConsumer = this._l2r.consumer
     this.r2lConsumer = this._r2l.consumer
+    if (l2rOptions.loop) this.l2rConsumer[Symbol.asyncIterator] = batches
+    if (r2lOptions.loop) this.r2lConsumer[Symbol.asyncIterator] = batches
+    this._l2rStream = streamOptions(l2rBufsize, l2rOptions)
+    this._r2lStream = streamOptions(r2lBufsize, r2lOptions)
     if (this.noDefaultListeners) return
 
     addDefaultListener(this, this.l2rConsumer)
@@ -65,16 +111,194 @@ class B3 {
     this._l2r.close()
     this._r2l.close()
   }
+  /**
+   * The left end of the B3 as a Duplex stream: what is written to it is sent
+   * left to right, what the right end writes is read from it. Needs the
+   * default l2rProducer and r2lConsumer.
+   * @param {object} options - of the Duplex, see B3.Duplex
+   */
+  left (options = {}) {
+    return new Duplex(this.l2rProducer, this.r2lConsumer, Object.assign({
+      messageSize: this._l2rStream.messageSize,
+      records: this._r2lStream.records
+    }, options))
+  }
+  /**
+   * The right end of the B3 as a Duplex stream, see left.
+   */
+  right (options = {}) {
+    return new Duplex(this.r2lProducer, this.l2rConsumer, Object.assign({
+      messageSize: this._r2lStream.messageSize,
+      records: this._l2rStream.records
+    }, options))
+  }
   static timeMs () {
     return Date.now() - start
   }
 }
+/**
+ * N left to right B2 instances of a network producer (see B3.netReader and
+ * B3.udpReader), each bound to the same ports with SO_REUSEPORT, so that the
+ * kernel spreads the flows across the producer threads of the shards.
+ */
+class Shards {
+  /**
+   * @param {uint} n - the number of shards
+   * @param {uint} producer - the network producer of each shard
+   * @param {uint} consumer - the consumer of each shard
+   * @param {utf8} data - data string of each shard, the ports to bind
+   * @param {uint} bufsize - the shared buffer size of each shard, 2^n
+   * @param {object} options - options of each shard, see B3; reusePort is
+   *   always on; shardCpus - the producer thread of shard i is pinned to
+   *   shardCpus[i % shardCpus.length]
+   */
+  constructor (n, producer, consumer = 0, data = '', bufsize = 16,
+    options = {}) {
+    options = Object.assign({}, options, { reusePort: true })
+    this.shards = []
+    for (var i = 0; i < n; i++) {
+      this.shards.push(B2.newB2(producer, consumer, data, bufsize,
+        Object.assign({ producerName: 'shard' + i }, options,
+          options.shardCpus
+            ? { producerCpus: options.shardCpus[i % options.shardCpus.length] }
+            : {})))
+    }
+    this.consumers = this.shards.map(b2 => b2.consumer)
+    this.owners = new WeakMap() // token or batch -> its consumer
+  }
+  /**
+   * Add the listener of the event to the consumers of all the shards; it
+   * gets the consumer of the shard as the last argument. The 'token' and
+   * 'tokens' listeners pass the token (the batch) to doneWith, the 'run'
+   * ones release the run through that consumer.
+   */
+  on (event, listener) {
+    this.consumers.forEach(consumer => consumer.on(event, (...args) => {
+      if (typeof args[0] === 'object') this.owners.set(args[0], consumer)
+      listener(...args, consumer)
+    }))
+  }
+  doneWith (token) {
+    this.owners.get(token).doneWith(token)
+  }
+  open () {
+    var opened = []
+    try {
+      this.shards.forEach(b2 => { b2.open(); opened.push(b2) })
+    } catch (e) {
+      opened.forEach(b2 => b2.close())
+      throw e
+    }
+  }
+  close () {
+    this.shards.forEach(b2 => b2.close())
+  }
+}
+
+/**
+ * The producer of a B2 as a Writable stream. Each chunk is sent in messages
+ * of up to messageSize bytes, of any bytes: a token records the length of
+ * its message, a record its size. The write callback waits for 'drain' when
+ * send() signals the backpressure. An empty message marks the end of the
+ * stream, see B3.Readable.
+ */
+class Writable extends stream.Writable {
+  /**
+   * @param {ProducerType} producer - a producer taking send(), the default
+   *   or the directSender
+   * @param {object} options - of the Writable; messageSize - the largest
+   *   message sent, 127 bytes by default (the TokenType message), up to
+   *   half the shared buffer less a record header in the record mode
+   */
+  constructor (producer, options = {}) {
+    super(options)
+    initWritable(this, producer, options)
+  }
+  _write (chunk, encoding, callback) {
+    writev(this, [{ chunk }], callback)
+  }
+  _writev (chunks, callback) {
+    writev(this, chunks, callback)
+  }
+  _final (callback) {
+    final(this, callback)
+  }
+}
+/**
+ * The default consumer of a B2 as a Readable stream. It reads each run of
+ * tokens in place (see the 'run' event) and releases the run once pushed,
+ * or, when the Readable is full, on the next _read; until then the shared
+ * buffer fills up and holds the producer back. An empty message ends the
+ * stream.
+ */
+class Readable extends stream.Readable {
+  /**
+   * @param {ConsumerType} consumer - the default consumer, with no listener
+   * @param {object} options - of the Readable; records - the B2 is in the
+   *   record mode (false)
+   */
+  constructor (consumer, options = {}) {
+    super(options)
+    initReadable(this, consumer, options)
+  }
+  _read () {
+    read(this)
+  }
+}
+/**
+ * A producer and a consumer, see B3.Writable and B3.Readable, as a Duplex
+ * stream; B3 left() and right() return the two ends of a B3.
+ */
+class Duplex extends stream.Duplex {
+  /**
+   * @param {ProducerType} producer - of the writable side
+   * @param {ConsumerType} consumer - of the readable side
+   * @param {object} options - of the Duplex, see B3.Writable and B3.Readable
+   */
+  constructor (producer, consumer, options = {}) {
+    super(options)
+    initWritable(this, producer, options)
+    initReadable(this, consumer, options)
+  }
+  _write (chunk, encoding, callback) {
+    writev(this, [{ chunk }], callback)
+  }
+  _writev (chunks, callback) {
+    writev(this, chunks, callback)
+  }
+  _final (callback) {
+    final(this, callback)
+  }
+  _read () {
+    read(this)
+  }
+}
+
+B3.Shards = Shards
+B3.Writable = Writable
+B3.Readable = Readable
+B3.Duplex = Duplex
 B3.defaults = 0 // producer and consumer Ids
 B3.sidSetter = 1 // producerId
 B3.bioFileReader = 2 // producerId
 B3.epollFileReader = 3 // producerId
+B3.directSender = 4 // producerId, send() and sendBuffer() on the main thread
+B3.mmapFileReader = 5 // producerId, the lines of the mapped file in place
+B3.uringFileReader = 6 // producerId
+B3.netReader = 7 // producerId, data lists the ports, 'udp:3001 tcp:3002\n'
+B3.udpReader = 8 // producerId, data is 'port\nhost:port', see udpWriter
 B3.bioFileWriter = 1 // consumerId
 B3.epollFileWriter = 2 // consumerId
+B3.uringFileWriter = 3 // consumerId
+B3.udpWriter = 4 // consumerId, sends to the host:port in data
+
+// The byte offsets and sizes of the tokens in consumer.buffer, and the
+// indexes of the produceCount and the consumeCount in consumer.indices, an
+// array of two Uint32Arrays of one element. The 'run' listener
+// of a consumer gets the byte offset of the first token in consumer.buffer
+// and the number of tokens in the run; it reads them in place and calls
+// consumer.release(n) when it is done with the first n of them.
+B3.layout = B2.layout
 
 module.exports = B3
 
@@ -89,8 +313,140 @@ function addDefaultListener (that, consumer) {
   })
 }
 
+// The async iterator of a loop consumer with no listener: each step pulls
+// all the tokens available in one call (see consumer.pull) and thereby
+// acknowledges those of the previous step, or waits for the 'readable'
+// event when there is none. The tokens are valid until the next step; it
+// ends once the B2 is closed. The iterators of a consumer share its one
+// 'readable' listener.
+function batches () {
+  var consumer = this
+  var batch = null // the tokens of the last step, to release on return
+
+  if (consumer._waiting === undefined) {
+    consumer._waiting = null // the resolve of the step waiting for 'readable'
+    consumer.on('readable', () => {
+      var resolve = consumer._waiting
+      consumer._waiting = null
+      if (resolve) resolve()
+    })
+  }
+  function next () {
+    batch = consumer.pull()
+    if (batch === null) {
+      return new Promise(resolve => { consumer._waiting = resolve }).then(next)
+    }
+    return Promise.resolve(batch === undefined
+      ? { value: undefined, done: true }
+      : { value: batch, done: false })
+  }
+  return {
+    next,
+    return () {
+      if (batch) consumer.release(batch.length)
+      batch = undefined
+      return Promise.resolve({ value: undefined, done: true })
+    },
+    [Symbol.asyncIterator] () {
+      return this
+    }
+  }
+}
+
 function selfTest (producer) {
   // console.log('+%d ms - selfTest producer.sid: %d',
   //   B3.timeMs(), producer.sid)
   producer.send('- selfTest message sent on ' + new Date())
 }
+
+// The bytes of a record of size bytes of message in the consumer.buffer, as
+// recordSpan in b2.h.
+function recordSpan (size) {
+  var layout = B2.layout
+
+  return (layout.recordHeader + size + layout.recordAlign) &
+    ~(layout.recordAlign - 1)
+}
+
+// The options of the streams of a B2 of bufsize and options, see B3 left.
+function streamOptions (bufsize, options) {
+  var layout = B2.layout
+  var records = !!options.records
+
+  return {
+    records,
+    messageSize: records
+      ? bufsize * layout.tokenMessageSize / 2 - recordSpan(0)
+      : layout.tokenMessageSize - 1
+  }
+}
+
+function initWritable (that, producer, options) {
+  that._producer = producer
+  that._messageSize = options.messageSize || B2.layout.tokenMessageSize - 1
+  that._waiting = null // the write callback waiting for 'drain'
+  producer.on('drain', () => {
+    var callback = that._waiting
+    that._waiting = null
+    if (callback) callback()
+  })
+}
+
+function writev (that, chunks, callback) {
+  var below = true
+  var size = that._messageSize
+
+  chunks.forEach(({ chunk }) => {
+    for (var i = 0; i < chunk.length; i += size) {
+      below = that._producer.sendBuffer(chunk.subarray(i, i + size))
+    }
+  })
+  if (below) callback()
+  else that._waiting = callback
+}
+
+function final (that, callback) {
+  that._producer.sendBuffer(Buffer.alloc(0))
+  callback()
+}
+
+function initReadable (that, consumer, options) {
+  var layout = B2.layout
+  var records = !!options.records
+  var bytes = new Uint8Array(consumer.buffer)
+  var view = new DataView(bytes.buffer)
+  var ended = false
+
+  that._consumer = consumer
+  that._held = 0 // tokens of the run to release on the next _read
+  consumer.on('run', (offset, n) => {
+    var more = true
+    var start, size
+
+    for (var i = 0; i < n && !ended; i++) {
+      if (records) {
+        start = offset + layout.recordMessage
+        size = view.getUint32(offset + layout.recordSize, true)
+        offset += recordSpan(size)
+      } else {
+        start = offset + layout.tokenMessage
+        size = view.getUint32(offset + layout.tokenLength, true)
+        offset += layout.tokenSize
+      }
+      if (size === 0) { // the end of the stream
+        ended = true
+        that.push(null)
+      } else more = that.push(Buffer.from(bytes.subarray(start, start + size)))
+    }
+    if (more || ended) consumer.release(n)
+    else that._held = n
+  })
+}
+
+function read (that) {
+  var n = that._held
+
+  if (n === 0) return
+  that._held = 0
+  that._consumer.release(n)
+}
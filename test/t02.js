@@ -4,6 +4,9 @@
 
 const assert = require('assert-plus')
 const { execSync } = require('child_process')
+const dgram = require('dgram')
+const fs = require('fs')
+const net = require('net')
 const B3 = require('../b3')
 
 var b3 = new B3()
@@ -12,6 +15,18 @@ var count = 1
 var bigfile = '/tmp/bigfile.t02'
 var bigfileCopyBio = '/tmp/bigfileCopyBio.t02'
 var bigfileCopyEpoll = '/tmp/bigfileCopyEpoll.t02'
+var bigfileCopyRecords = '/tmp/bigfileCopyRecords.t02'
+var bigfileCopyEpollWriter = '/tmp/bigfileCopyEpollWriter.t02'
+var bigfileCopyMmap = '/tmp/bigfileCopyMmap.t02'
+var bigfileCopyUring = '/tmp/bigfileCopyUring.t02'
+var bigfileCopySpin = '/tmp/bigfileCopySpin.t02'
+var bigfileCopyStream = '/tmp/bigfileCopyStream.t02'
+var bigfileCopyFlush = '/tmp/bigfileCopyFlush.t02'
+var bigfileCopyThrough = '/tmp/bigfileCopyThrough.t02'
+var fifo = '/tmp/fifo.t02'
+var missingFile = '/tmp/missing.t02'
+var emptyFile = '/tmp/empty.t02'
+var longLineFile = '/tmp/longLine.t02'
 
 describe('A B3 module:', () => {
   before(removeFiles)
@@ -55,34 +70,643 @@ describe('A B3 module:', () => {
     if (process.platform === 'linux') epollCopyFile(done)
     else this.skip()
   }).timeout(4000)
+  it('copies the file with the epoll writer', function (done) {
+    if (process.platform === 'linux') epollWriteFile(done)
+    else this.skip()
+  }).timeout(2000)
+  it('copies the mapped file', done => mmapCopyFile(done)
+  ).timeout(2000)
+  it('copies the file with io_uring', function (done) {
+    if (process.platform === 'linux') uringCopyFile(done)
+    else this.skip()
+  }).timeout(2000)
+  it('copies the file as variable-length records', done => recordsCopyFile(done)
+  ).timeout(2000)
+  it('passes long messages as records', done => recordsLongMessage(done)
+  ).timeout(200)
+  it('sends buffers straight into the shared buffer', done => directSend(done)
+  ).timeout(200)
+  it('delivers the tokens in batches', done => deliverBatches(done)
+  ).timeout(200)
+  it('keeps a window of tokens in flight', done => windowInFlight(done)
+  ).timeout(200)
+  it('reuses the token objects of the shared buffer', done => reuseTokens(done)
+  ).timeout(200)
+  it('reads the tokens in place', done => readInPlace(done)
+  ).timeout(200)
+  it('ingests UDP datagrams and TCP lines', function (done) {
+    if (process.platform === 'linux') netIngest(done)
+    else this.skip()
+  }).timeout(2000)
+  it('relays datagrams in batches', function (done) {
+    if (process.platform === 'linux') udpRelay(done)
+    else this.skip()
+  }).timeout(2000)
+  it('reports the socket errors on open', function (done) {
+    if (process.platform === 'linux') socketErrors(done)
+    else this.skip()
+  }).timeout(200)
+  it('shards the ingest across the ports reused', function (done) {
+    if (process.platform === 'linux') shardedIngest(done)
+    else this.skip()
+  }).timeout(2000)
+  it('copies the file with the threads spinning', done => spinCopyFile(done)
+  ).timeout(4000)
+  it('pins and names the threads', function (done) {
+    if (process.platform === 'linux') pinThreads(done)
+    else this.skip()
+  }).timeout(200)
+  it('drains the shared buffer on the event loop', function (done) {
+    if (process.platform === 'linux') loopConsumer(done)
+    else this.skip()
+  }).timeout(200)
+  it('bounds the tokens queued with a fixed pool', done => poolExhausted(done)
+  ).timeout(200)
+  it('signals the backpressure to send()', done => drainEvent(done)
+  ).timeout(2000)
+  it('pipes the file through the stream ends', done => pipeFile(done)
+  ).timeout(4000)
+  it('iterates the batches of the loop consumer', function (done) {
+    if (process.platform === 'linux') iterateBatches(done)
+    else this.skip()
+  }).timeout(200)
+  it('acknowledges the batches of the shards', function (done) {
+    if (process.platform === 'linux') shardedBatches(done)
+    else this.skip()
+  }).timeout(2000)
+  it('keeps the records of the netReader in flight', function (done) {
+    if (process.platform === 'linux') netRecords(done)
+    else this.skip()
+  }).timeout(2000)
+  it('streams binary chunks through the token slots', done => pipeBinary(done)
+  ).timeout(2000)
+  it('closes the epoll reader waiting on a FIFO', function (done) {
+    if (process.platform === 'linux') epollCloseFifo(done)
+    else this.skip()
+  }).timeout(2000)
+  it('flushes the staged output of the file writer', done =>
+    flushCopyFile(4096, bigfileCopyFlush,
+      () => flushCopyFile(0, bigfileCopyThrough, done))
+  ).timeout(4000)
 })
 
-function epollCopyFile (done) {
+async function iterateBatches (done) {
+  var b3 = new B3(0, 0, 0, 0, 4, 4, '', '', true, true, { loop: true })
+  var count = 0
+  var batches = 0
+
+  b3.r2lConsumer.on('token', t => b3.r2lConsumer.doneWith(t))
+  b3.open()
+  for (var i = 0; i < 10; i++) b3.l2rProducer.send(`message ${i}`)
+  assert.ok(!(Symbol.asyncIterator in b3.r2lConsumer)) // a thread consumer
+  for await (const batch of b3.l2rConsumer) {
+    batches++
+    batch.forEach(t => assert.equal(t.message, `message ${count++}`))
+    break // releases the batch
+  }
+  for (i = 10; i < 20; i++) b3.l2rProducer.send(`message ${i}`)
+  for await (const batch of b3.l2rConsumer) {
+    assert.ok(batch.length >= 1 && batch.length <= 4)
+    batches++
+    batch.forEach(t => assert.equal(t.message, `message ${count++}`))
+    if (count === 20) b3.close()
+  }
+  assert.equal(count, 20)
+  assert.ok(batches >= 5)
+  done()
+}
+
+function pipeFile (done) {
+  var b3 = new B3(0, 0, 0, 0, 64, 16, '', '', true, true, { records: true })
+  var left = b3.left()
+  var right = b3.right()
+
+  fs.createReadStream(bigfile).pipe(left)
+  right.pipe(fs.createWriteStream(bigfileCopyStream)).on('finish', () => {
+    assert.ok(fs.readFileSync(bigfile).equals(
+      fs.readFileSync(bigfileCopyStream)))
+    b3.close()
+    done()
+  })
+  b3.open()
+}
+
+function drainEvent (done) {
+  var b3 = new B3(0, 0, 0, 0, 2, 2, '', '', true, true,
+    { highWaterMark: 4, lowWaterMark: 1 })
+  var producer = b3.l2rProducer
+  var sent = 0
+  var count = 0
+  var drains = 0
+  var write = () => {
+    while (sent < 40) if (!producer.send(`message ${sent++}`)) return
+  }
+
+  assert.throws(() => new B3(0, 0, 0, 0, 2, 2, '', '', true, true,
+    { highWaterMark: 4, lowWaterMark: 5 }), RangeError)
+  assert.throws(() => producer.on('drained', () => {}), TypeError)
+
+  producer.on('drain', () => {
+    drains++
+    write()
+  })
+  b3.l2rConsumer.on('token', t => {
+    assert.equal(t.message, `message ${count++}`)
+    setImmediate(() => {
+      b3.l2rConsumer.doneWith(t)
+      if (count < 40) return
+      assert.ok(drains > 0)
+      b3.close()
+      done()
+    })
+  })
+  b3.r2lConsumer.on('token', t => b3.r2lConsumer.doneWith(t))
+  b3.open()
+  write()
+  assert.ok(sent < 40)
+}
+
+function poolExhausted (done) {
+  var b3 = new B3(0, 0, 0, 0, 2, 2, '', '', true, true,
+    { poolSize: 4, poolGrowth: 0 })
+  var sent = 0
+  var count = 0
+
+  b3.l2rConsumer.on('token', t => {
+    assert.equal(t.message, count < sent ? `message ${count}` : 'last')
+    b3.l2rConsumer.doneWith(t)
+    if (++count === sent) b3.l2rProducer.send('last')
+    if (count <= sent) return
+    b3.close()
+    done()
+  })
+  b3.r2lConsumer.on('token', t => b3.r2lConsumer.doneWith(t))
+  b3.open()
+  assert.throws(() => {
+    for (;;) { b3.l2rProducer.send(`message ${sent}`); sent++ }
+  }, RangeError)
+  assert.ok(sent >= 4)
+}
+
+function loopConsumer (done) {
+  var b3 = new B3(0, 0, 0, 0, 4, 4, '', '', true, true,
+    { loop: true, consumerName: 'loopc' })
+  var layout = B3.layout
+  var consumer = b3.l2rConsumer
+  var view = new DataView(consumer.buffer)
+  var decoder = new TextDecoder()
+  var count = 0
+
+  consumer.on('run', (offset, n) => {
+    var message = new Uint8Array(view.buffer, offset + layout.tokenMessage,
+      layout.tokenMessageSize)
+    assert.ok(n >= 1 && n <= 4)
+    assert.equal(view.getUint32(offset + layout.tokenSid, true), count)
+    assert.equal(decoder.decode(message.subarray(0, message.indexOf(0))),
+      `message ${count}`)
+    if (++count % 2) release(count) // the rest of the run follows
+    else setImmediate(release, count)
+  })
+  function release (k) { // the release drains the next runs right away
+    consumer.release(1)
+    if (k < 20) return
+    assert.ok(!fs.readdirSync('/proc/self/task').find(tid => fs.readFileSync(
+      `/proc/self/task/${tid}/comm`, 'utf8').trim() === 'loopc'))
+    b3.close()
+    done()
+  }
+  assert.throws(() => consumer.on('token', () => {}))
+  b3.r2lConsumer.on('token', t => b3.r2lConsumer.doneWith(t))
+  b3.open()
+  for (var i = 0; i < 20; i++) b3.l2rProducer.send(`message ${i}`)
+}
+
+function pinThreads (done) {
+  var b3 = new B3(0, 0, 0, 0, 16, 0, '', '', false, false, {
+    producerCpus: [0],
+    producerName: 'pinned',
+    consumerName: 'named'
+  })
+  var threads = () => fs.readdirSync('/proc/self/task').map(tid => ({
+    name: fs.readFileSync(`/proc/self/task/${tid}/comm`, 'utf8').trim(),
+    status: fs.readFileSync(`/proc/self/task/${tid}/status`, 'utf8')
+  }))
+
+  b3.open()
+
+  // The threads pin and name themselves as they start.
+  ;(function started () {
+    var all = threads()
+    var pinned = all.find(t => t.name === 'pinned')
+    if (!pinned || !all.find(t => t.name === 'named') ||
+      !all.find(t => /^b2p\d+$/.test(t.name))) { // the r2l producer
+      return setImmediate(started)
+    }
+    assert.ok(/Cpus_allowed_list:\s+0\n/.test(pinned.status))
+    b3.close()
+    done()
+  })()
+}
+
+function shardedIngest (done) {
+  freePort('udp', udpPort => freePort('tcp', tcpPort =>
+    shardedIngestOn(udpPort, tcpPort, done)))
+}
+
+function shardedIngestOn (udpPort, tcpPort, done) {
+  var shards = new B3.Shards(4, B3.netReader, B3.defaults,
+    `udp:${udpPort} tcp:${tcpPort}\n`)
+  var senders = []
+  var received = 0
+  var consumers = new Set()
+  var n = 16
+
+  shards.on('token', (t, consumer) => {
+    assert.ok(t.message.startsWith('from sender'))
+    consumers.add(consumer)
+    shards.doneWith(t)
+    if (++received < n + 1) return
+    assert.ok(consumers.size > 1) // 16 flows hashed to 4 shards
+    senders.forEach(s => s.close())
+    shards.close()
+    done()
+  })
+  shards.open() // binds the ports of all the shards
+  for (var i = 0; i < n; i++) senders.push(dgram.createSocket('udp4'))
+  senders.forEach((s, i) => s.send('from sender ' + i, udpPort, '127.0.0.1'))
+  var tcp = net.connect(tcpPort, '127.0.0.1',
+    () => tcp.end('from sender tcp\n'))
+}
+
+function socketErrors (done) {
+  var socket = dgram.createSocket('udp4')
+
+  socket.bind(0, () => {
+    var port = socket.address().port
+    var b3 = new B3(
+      B3.udpReader, // l2rProducer
+      B3.udpWriter, // l2rConsumer
+      B3.defaults, // r2lProducer
+      B3.defaults, // r2lConsumer
+      16, // l2rBufsize
+      2, // r2lBufsize
+      `${port}\n127.0.0.1:${port}`, // l2rData
+      '', false, false,
+      { rcvbuf: 1 << 20 } // l2rOptions
+    )
+    assert.throws(() => b3.open(),
+      new RegExp(`bind ${port}: Address already in use`))
+    socket.close()
+    done()
+  })
+}
+
+function udpRelay (done) {
+  freePort('udp', port => udpRelayFrom(port, done))
+}
+
+function udpRelayFrom (port, done) {
+  var b3
+  var sender = dgram.createSocket('udp4')
+  var receiver = dgram.createSocket('udp4')
+  var n = 100 // fits the socket receive buffers, UDP drops the overflow
+  var received = 0
+  var closed = false
+  var probing = true
+
+  function finish () {
+    if (received < n || !closed) return
+    sender.close()
+    receiver.close()
+    b3.close()
+    done()
+  }
+  receiver.on('message', m => {
+    if (m.toString() !== 'probe') {
+      assert.strictEqual(m.toString(), 'datagram ' + received++)
+      finish()
+    } else if (probing) {
+      probing = false
+      for (var i = 0; i < n; i++) sender.send('datagram ' + i, port, '127.0.0.1')
+      sender.send(Buffer.alloc(0), port, '127.0.0.1') // eot
+    }
+  })
+  receiver.bind(0, () => {
+    b3 = new B3(
+      B3.udpReader, // l2rProducer
+      B3.udpWriter, // l2rConsumer
+      B3.defaults, // r2lProducer
+      B3.defaults, // r2lConsumer
+      256, // l2rBufsize
+      2, // r2lBufsize
+      `${port}\n127.0.0.1:${receiver.address().port}` // l2rData
+    )
+    b3.r2lConsumer.on('token', t => { // the udpWriter is closed on eot
+      b3.r2lConsumer.doneWith(t)
+      closed = true
+      finish()
+    })
+    b3.open()
+
+    // The producer thread binds its port after open: probe it until the
+    // first probe is relayed.
+    ;(function probe () {
+      if (!probing) return
+      sender.send('probe', port, '127.0.0.1')
+      setImmediate(probe)
+    })()
+  })
+}
+
+function netIngest (done) {
+  freePort('udp', udpPort => freePort('tcp', tcpPort =>
+    netIngestOn(udpPort, tcpPort, done)))
+}
+
+function netIngestOn (udpPort, tcpPort, done) {
   var b3 = new B3(
-    B3.epollFileReader, // l2rProducer
-    B3.bioFileWriter, // l2rConsumer
+    B3.netReader, // l2rProducer
+    B3.defaults, // l2rConsumer
     B3.defaults, // r2lProducer
     B3.defaults, // r2lConsumer
-    256, // l2rBufsize
+    16, // l2rBufsize
     2, // r2lBufsize
-    bigfile + '\n' + bigfileCopyEpoll // l2rData
+    `udp:${udpPort} tcp:${tcpPort}\n`, // l2rData
+    '', true, true
   )
+  var expected = ['line 1\n', 'line 2\n', 'datagram 1', 'datagram 2']
+  var sources = {}
+  var udp = dgram.createSocket('udp4')
+  var tcp
+
+  b3.l2rConsumer.on('token', t => {
+    var i = expected.indexOf(t.message)
+    assert.ok(i >= 0, t.message)
+    expected.splice(i, 1)
+    sources[t.message.split(' ')[0]] = t.source
+    b3.l2rConsumer.doneWith(t)
+    if (expected.length) return
+    assert.ok(sources.line > 0 && sources.datagram > 0)
+    assert.notStrictEqual(sources.line, sources.datagram)
+    tcp.end()
+    udp.close()
+    b3.close()
+    done()
+  })
+  b3.r2lConsumer.on('token', t => b3.r2lConsumer.doneWith(t))
+  b3.open()
+
+  // The producer thread binds the UDP port before it listens on the TCP one.
+  ;(function connect () {
+    tcp = net.connect(tcpPort, '127.0.0.1', () => {
+      tcp.write('line 1\nline ')
+      tcp.write('2\n')
+      udp.send('datagram 1', udpPort, '127.0.0.1')
+      udp.send('datagram 2', udpPort, '127.0.0.1')
+    })
+    tcp.on('error', () => setImmediate(connect))
+  })()
+}
+
+function readInPlace (done) {
+  var b3 = new B3(0, 0, 0, 0, 4, 4, '', '', true, true)
+  var layout = B3.layout
+  var consumer = b3.l2rConsumer
+  var view = new DataView(consumer.buffer)
+  var indices = consumer.indices
+  var decoder = new TextDecoder()
+  var count = 0
+
+  consumer.on('run', (offset, n) => {
+    assert.ok(n >= 1 && n <= 4)
+    assert.ok(indices[layout.produceCount][0] -
+      indices[layout.consumeCount][0] >= n)
+    for (var i = 0; i < n; i++, offset += layout.tokenSize) {
+      var message = new Uint8Array(view.buffer, offset + layout.tokenMessage,
+        layout.tokenMessageSize)
+      assert.equal(view.getUint32(offset + layout.tokenSid, true), count)
+      assert.equal(decoder.decode(message.subarray(0, message.indexOf(0))),
+        `message ${count++}`)
+    }
+    if (n > 1) consumer.release(1) // the releases of a run add up
+    consumer.release(n > 1 ? n - 1 : n)
+    if (count < 10) return
+    assert.equal(consumer.buffer, view.buffer)
+    b3.close()
+    // Detached once the listener of the closed b2 is released.
+    finalized(() => view.buffer.byteLength === 0, done)
+  })
+  b3.r2lConsumer.on('token', t => b3.r2lConsumer.doneWith(t))
+  b3.open()
+  for (var i = 0; i < 10; i++) b3.l2rProducer.send(`message ${i}`)
+}
+
+// Wait for the b2 closed to be finalized.
+function finalized (stale, done) {
+  if (stale()) done()
+  else setImmediate(finalized, stale, done)
+}
+
+function reuseTokens (done) {
+  var b3 = new B3(0, 0, 0, 0, 2, 2, '', '', true, true)
+  var tokens = []
+
+  b3.l2rConsumer.on('token', t => {
+    assert.equal(t.message, `message ${tokens.length}`)
+    tokens.push(t)
+    b3.l2rConsumer.doneWith(t)
+    if (tokens.length < 4) return
+    assert.notStrictEqual(tokens[0], tokens[1])
+    assert.strictEqual(tokens[0], tokens[2])
+    assert.strictEqual(tokens[1], tokens[3])
+    b3.close()
+    finalized(() => {
+      try {
+        return !tokens[0].message
+      } catch (e) {
+        return /closed/.test(e.message)
+      }
+    }, done)
+  })
+  b3.r2lConsumer.on('token', t => b3.r2lConsumer.doneWith(t))
+  b3.open()
+  for (var i = 0; i < 4; i++) b3.l2rProducer.send(`message ${i}`)
+}
+
+function windowInFlight (done) {
+  var b3 = new B3(0, 0, 0, 0, 4, 4, '', '', true, true, { window: 3 })
+  var count = 0
+  var inFlight = 0
+  var maxInFlight = 0
+  var held = []
+
+  b3.l2rConsumer.on('token', t => {
+    assert.equal(t.message, `message ${count++}`)
+    maxInFlight = Math.max(maxInFlight, ++inFlight)
+    if (held.push([t, t.message]) === 1) setImmediate(doneWithHeld)
+  })
+  function doneWithHeld () {
+    while (held.length) { // the later tokens are done with first
+      var [token, message] = held.pop()
+      assert.equal(token.message, message)
+      inFlight--
+      b3.l2rConsumer.doneWith(token)
+    }
+    if (count < 12) return
+    assert.equal(maxInFlight, 3)
+    b3.close()
+    done()
+  }
+  b3.r2lConsumer.on('token', t => b3.r2lConsumer.doneWith(t))
+  b3.open()
+  for (var i = 0; i < 12; i++) b3.l2rProducer.send(`message ${i}`)
+}
+
+function deliverBatches (done) {
+  var b3 = new B3(0, 0, 0, 0, 4, 64, '', '', true, true,
+    {}, { records: true })
+  var count = 0
+
+  b3.l2rConsumer.on('tokens', batch => {
+    assert.ok(batch.length >= 1 && batch.length <= 4)
+    batch.forEach(t => assert.equal(t.message, `message ${count++}`))
+    b3.l2rConsumer.doneWith(batch)
+    if (count === 20) b3.r2lProducer.send(`${count} messages`)
+  })
+  b3.r2lConsumer.on('tokens', batch => {
+    assert.equal(batch.length, 1)
+    assert.equal(batch[0].message, '20 messages')
+    b3.r2lConsumer.doneWith(batch)
+    b3.close()
+    done()
+  })
+  assert.throws(() => b3.l2rConsumer.on('token', t => {}), /already/)
+  assert.throws(() => new B3(0, 0, 0, 0, 4, 4, '', '', true, true)
+    .l2rConsumer.on('tokenz', t => {}), /unknown/)
+  b3.open()
+  for (var i = 0; i < 20; i++) b3.l2rProducer.send(`message ${i}`)
+}
+
+function directSend (done) {
+  var b3 = new B3(B3.directSender, 0, 0, 0, 2, 2, '', '', true, true)
+  var count = 0
+
+  b3.l2rConsumer.on('token', t => {
+    assert.equal(t.sid, count)
+    assert.equal(t.message, `buffer ${count}`)
+    b3.l2rConsumer.doneWith(t)
+    if (++count === 8) {
+      b3.close()
+      done()
+    }
+  })
+  b3.r2lConsumer.on('token', t => b3.r2lConsumer.doneWith(t))
+  for (var i = 0; i < 8; i++) {
+    if (i === 2) b3.open() // the tokens sent before are queued
+    if (i % 2) b3.l2rProducer.send(`buffer ${i}`)
+    else b3.l2rProducer.sendBuffer(Buffer.from(`buffer ${i}`))
+  }
+}
+
+function epollWriteFile (done) {
+  var noReader = new B3(B3.bioFileReader, B3.epollFileWriter, 0, 0, 16, 2,
+    bigfile + '\n' + fifo)
+
+  assert.throws(() => noReader.open(),
+    /open \/tmp\/fifo.t02: No such device or address/)
+  noReader.close() // the epollFileWriter reports to the last b2 created
+  copyFile(bigfile, bigfileCopyEpollWriter, B3.bioFileReader,
+    B3.epollFileWriter, 256, {}, done)
+}
+
+function mmapCopyFile (done) {
+  copyFiles(B3.mmapFileReader, B3.bioFileWriter, 256, bigfileCopyMmap, {},
+    done)
+}
+
+function uringCopyFile (done) {
+  copyFiles(B3.uringFileReader, B3.uringFileWriter, 256, bigfileCopyUring, {},
+    done)
+}
+
+function recordsCopyFile (done) {
+  copyFiles(B3.bioFileReader, B3.bioFileWriter, 16, bigfileCopyRecords,
+    { records: true }, done)
+}
+
+function recordsLongMessage (done) {
+  var b3 = new B3(0, 0, 0, 0, 64, 64, '', '', true, true,
+    { records: true }, { records: true })
+  var message = 'x'.repeat(3000)
+
+  assert.throws(() => b3.l2rProducer.send('x'.repeat(5000)), RangeError)
+  assert.throws(() => new B3(B3.mmapFileReader, 0, 0, 0, 64, 64, bigfile, '',
+    true, true, { records: true }), RangeError)
+  assert.throws(() => new B3(0, 0, 0, 0, 48, 64, '', '', true, true,
+    { records: true }), RangeError)
+  b3.l2rConsumer.on('token', t => {
+    assert.equal(t.message, message)
+    b3.l2rConsumer.doneWith(t)
+    b3.r2lProducer.send(`echo ${t.message.length} bytes back`)
+  })
+  b3.r2lConsumer.on('token', t => {
+    assert.equal(t.message, 'echo 3000 bytes back')
+    b3.r2lConsumer.doneWith(t)
+    b3.close()
+    done()
+  })
+  b3.open()
+  b3.l2rProducer.send(message)
+}
+
+function epollCopyFile (done) {
+  copyFiles(B3.epollFileReader, B3.bioFileWriter, 256, bigfileCopyEpoll, {},
+    done)
+}
+
+function bioCopyFile (done) {
+  copyFiles(B3.bioFileReader, B3.bioFileWriter, 256, bigfileCopyBio, {}, done)
+}
+
+// Copy from into copy with the l2r producer and consumer, and compare the
+// files once the b2 has been closed on the token echoed back.
+function copyFile (from, copy, l2rProducer, l2rConsumer, l2rBufsize,
+  l2rOptions, done) {
+  var b3 = new B3(l2rProducer, l2rConsumer, 0, 0, l2rBufsize, 2,
+    from + '\n' + copy, '', false, false, l2rOptions)
   var notDone = true
 
   b3.r2lConsumer.on('token', t => {
-    // console.log('+%d ms consumer sid %d, token sid %d, message "%s", delay %dµs',
-    //  B3.timeMs(), b3.r2lConsumer.sid, t.sid, t.message, t.delay)
     b3.r2lConsumer.doneWith(t)
     if (notDone) {
+      notDone = false
       b3.close()
+      execSync(`cmp ${from} ${copy}`)
       done()
-      notDone = false
     }
   })
   b3.open()
 }
 
-function bioCopyFile (done) {
+// Copy with the file reader of l2rProducer: open() throws on a missing file,
+// then an empty file, a line longer than a slot and the bigfile are copied.
+// The writers do not truncate, so each copy has its own file.
+function copyFiles (l2rProducer, l2rConsumer, l2rBufsize, copy, l2rOptions,
+  done) {
+  var missing = new B3(l2rProducer, l2rConsumer, 0, 0, l2rBufsize, 2,
+    missingFile + '\n' + copy, '', false, false, l2rOptions)
+  var copyWith = (from, to, next) => copyFile(from, to, l2rProducer,
+    l2rConsumer, l2rBufsize, l2rOptions, next)
+
+  assert.throws(() => missing.open(),
+    /open \/tmp\/missing.t02: No such file or directory/)
+  missing.close() // the writers report to the last b2 created
+  copyWith(emptyFile, copy + '.empty', () =>
+    copyWith(longLineFile, copy + '.long', () =>
+      copyWith(bigfile, copy, done)))
+}
+
+function spinCopyFile (done) {
   var b3 = new B3(
     B3.bioFileReader, // l2rProducer
     B3.bioFileWriter, // l2rConsumer
@@ -90,16 +714,20 @@ function bioCopyFile (done) {
     B3.defaults, // r2lConsumer
     256, // l2rBufsize
     2, // r2lBufsize
-    bigfile + '\n' + bigfileCopyBio // l2rData
+    bigfile + '\n' + bigfileCopySpin, // l2rData
+    '', false, false,
+    { wait: 'yield', spinBudget: 100 }, // l2rOptions
+    { wait: 'spinPark' } // r2lOptions
   )
   var notDone = true
 
+  assert.throws(() => new B3(0, 0, 0, 0, 16, 0, '', '', false, false,
+    { wait: 'nap' }), /unknown wait strategy/)
   b3.r2lConsumer.on('token', t => {
-    // console.log('+%d ms consumer sid %d, token sid %d, message "%s", delay %dµs',
-    //  B3.timeMs(), b3.r2lConsumer.sid, t.sid, t.message, t.delay)
     b3.r2lConsumer.doneWith(t)
     if (notDone) {
       b3.close()
+      execSync(`cmp ${bigfile} ${bigfileCopySpin}`)
       done()
       notDone = false
     }
@@ -108,7 +736,14 @@ function bioCopyFile (done) {
 }
 
 function removeFiles () {
-  execSync(`rm -f ${bigfile} ${bigfileCopyBio} ${bigfileCopyEpoll}`)
+  execSync(`rm -f ${bigfile} ${bigfileCopyBio} ${bigfileCopyEpoll} ` +
+    `${bigfileCopyRecords} ${bigfileCopyEpollWriter} ${bigfileCopyMmap} ` +
+    `${bigfileCopyUring} ${bigfileCopySpin} ${bigfileCopyStream} ${fifo} ` +
+    `${bigfileCopyFlush} ${bigfileCopyThrough} ${emptyFile} ${longLineFile}`)
+  execSync(`rm -f /tmp/*.t02.empty /tmp/*.t02.long`)
+  if (process.platform === 'linux') execSync(`mkfifo ${fifo}`)
+  fs.writeFileSync(emptyFile, '')
+  fs.writeFileSync(longLineFile, 'x'.repeat(300) + '\n' + 'a short line\n')
 }
 
 function bioWriteFile (done) {
@@ -182,3 +817,108 @@ function b3common (functionName, timeoutMs) {
   })
   return b3
 }
+
+function shardedBatches (done) {
+  freePort('udp', port => shardedBatchesOn(port, done))
+}
+
+function shardedBatchesOn (port, done) {
+  var shards = new B3.Shards(2, B3.netReader, B3.defaults, `udp:${port}\n`)
+  var sender = dgram.createSocket('udp4')
+  var received = 0
+
+  shards.on('tokens', batch => {
+    batch.forEach(t => assert.ok(t.message.startsWith('datagram')))
+    received += batch.length
+    shards.doneWith(batch)
+    if (received < 8) return
+    sender.close()
+    shards.close()
+    done()
+  })
+  shards.open()
+  for (var i = 0; i < 8; i++) sender.send('datagram ' + i, port, '127.0.0.1')
+}
+
+function netRecords (done) {
+  freePort('udp', port => netRecordsOn(port, done))
+}
+
+function netRecordsOn (port, done) {
+  var b3 = new B3(B3.netReader, B3.defaults, 0, 0, 16, 2, `udp:${port}\n`,
+    '', true, true, { records: true, window: 8 })
+  var sender = dgram.createSocket('udp4')
+  var datagram = i => ('datagram ' + i).padEnd(200, '.') // 8 fill 7/8 of 2048
+  var held = []
+
+  b3.l2rConsumer.on('token', t => {
+    assert.equal(t.message, datagram(held.length))
+    if (held.push(t) < 8) return // each record reserves its own span only
+    held.forEach(t => b3.l2rConsumer.doneWith(t))
+    sender.close()
+    b3.close()
+    done()
+  })
+  b3.r2lConsumer.on('token', t => b3.r2lConsumer.doneWith(t))
+  b3.open()
+  for (var i = 0; i < 8; i++) sender.send(datagram(i), port, '127.0.0.1')
+}
+
+function epollCloseFifo (done) {
+  var b3 = new B3(B3.epollFileReader, 0, 0, 0, 1, 4, fifo + '\n')
+  var writer = fs.openSync(fifo, 'r+') // the reader opens it without waiting
+  var buffer = b3.l2rConsumer.buffer
+  var closed = false
+
+  b3.l2rConsumer.on('token', t => {
+    b3.l2rConsumer.doneWith(t)
+    if (closed) return // the end of transmission of the reader woken
+    closed = true
+    assert.equal(t.message, 'a line, and no end of the file\n')
+    b3.close() // the reader waits for the next line of the FIFO
+    finalized(() => buffer.byteLength === 0, () => {
+      fs.closeSync(writer)
+      done()
+    })
+  })
+  b3.r2lConsumer.on('token', t => b3.r2lConsumer.doneWith(t))
+  b3.open()
+  fs.writeSync(writer, 'a line, and no end of the file\n')
+}
+
+function flushCopyFile (flushThreshold, copy, done) {
+  // The close() of copyFile flushes the tail staged below flushThreshold.
+  copyFile(bigfile, copy, B3.bioFileReader, B3.bioFileWriter, 256,
+    { flushThreshold }, done)
+}
+
+// A port the system has just bound for type, 'udp' or 'tcp', and released
+// for the producer threads to bind.
+function freePort (type, callback) {
+  var socket = type === 'tcp' ? net.createServer() : dgram.createSocket('udp4')
+  var bound = () => {
+    var port = socket.address().port
+    socket.close(() => callback(port))
+  }
+
+  if (type === 'tcp') socket.listen(0, bound)
+  else socket.bind(0, bound)
+}
+
+function pipeBinary (done) {
+  var b3 = new B3(0, 0, 0, 0, 16, 16, '', '', true, true)
+  var left = b3.left()
+  var right = b3.right()
+  var chunk = Buffer.from([0, 1, 0, 2, 255]) // no end of the stream at 0
+  var chunks = []
+
+  left.on('data', c => chunks.push(c))
+  left.on('end', () => {
+    assert.ok(Buffer.concat(chunks).equals(Buffer.concat([chunk, chunk])))
+    b3.close()
+    done()
+  })
+  b3.open()
+  right.write(chunk)
+  right.end(chunk)
+}